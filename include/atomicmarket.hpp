@@ -6,12 +6,37 @@
 
 #include <atomicassets-interface.hpp>
 #include <delphioracle-interface.hpp>
+#include <delphi-conversion.hpp>
+#include <listing-memo.hpp>
 
 using namespace std;
 using namespace eosio;
 
 static constexpr name DEFAULT_MARKETPLACE_CREATOR = name("fees.atomic");
 
+// Number of the most recent delphioracle datapoints that are searched for the intended median of a purchase
+static constexpr uint64_t DELPHI_MEDIAN_LOOKBACK = 10;
+
+// Seconds for which a cached delphi median is reused if the config does not specify a window yet
+static constexpr uint32_t DEFAULT_DELPHI_CACHE_WINDOW = 30;
+
+// Longest delphi cache window that can be set, so that purchases can't be settled at a median that is very old
+static constexpr uint32_t MAX_DELPHI_CACHE_WINDOW = 300;
+
+// Fees and the minimum bid increase are calculated as integers in parts per million (1% = 10000)
+static constexpr uint64_t FEE_PPM_SCALE = 1000000;
+
+// Number of sales that are checked when searching a new floor, so that removing a floor sale has a bounded cost
+static constexpr uint64_t FLOOR_SEARCH_LIMIT = 20;
+
+// Bytes of the seller's RAM deposit that are used up by a sale or auction that is listed with a memo
+// This is more than the listing row, its locator, their index entries and the tables of a new collection take
+static constexpr uint64_t MEMO_LISTING_RAM_BYTES = 2048;
+static constexpr uint64_t MEMO_LISTING_RAM_BYTES_PER_ASSET = 16;
+
+// The largest RAM deposit an account can have, so that the deposit row stays cheap to rewrite
+static constexpr uint64_t MAX_RAM_DEPOSIT_BYTES = 65536;
+
 
 /**
 * This function takes a vector of asset ids, sorts them and then returns the sha256 hash
@@ -27,14 +52,234 @@ checksum256 hash_asset_ids(const vector <uint64_t> &asset_ids) {
 };
 
 
+/**
+* Checks whether both vectors include exactly the same asset ids in any order
+* Both vectors are sorted, so that they can be compared linearly
+*/
+bool are_same_asset_ids(vector <uint64_t> asset_ids_a, vector <uint64_t> asset_ids_b) {
+    if (asset_ids_a.size() != asset_ids_b.size()) {
+        return false;
+    }
+
+    std::sort(asset_ids_a.begin(), asset_ids_a.end());
+    std::sort(asset_ids_b.begin(), asset_ids_b.end());
+    return asset_ids_a == asset_ids_b;
+};
+
+
+/**
+* Gets the asset ids hash that is stored in sales and auctions
+* Listings of a single asset are found through their asset id instead, so they store an empty hash
+* and don't need to be hashed when they are announced or looked up
+* 
+* This saves CPU, not RAM: every row still has an entry in both the asset ids hash and the asset id index,
+* so single asset rows keep an empty 32 byte hash key and bundles keep an asset id key of 0
+*/
+checksum256 get_stored_asset_ids_hash(const vector <uint64_t> &asset_ids) {
+    return asset_ids.size() == 1 ? checksum256() : hash_asset_ids(asset_ids);
+};
+
+
+/**
+* Checks if a sale or auction was created before the asset ids hash was stored in it, or is a single asset
+* row that still stores the full hash from before single asset rows were added to the asset id index
+*/
+template <typename T>
+bool is_unconverted_listing(const T &listing) {
+    return !listing.asset_ids_hash.has_value()
+        || (listing.asset_ids.size() == 1 && listing.asset_ids_hash.value() != checksum256());
+};
+
+
+/**
+* Converts a fee given as a fraction (e.g. 0.01 for 1%) into parts per million
+* This is only needed when a fee is set or when reading rows that were written before fees were stored
+* as integers, so that payouts themselves never need floating point operations
+*/
+uint32_t fee_to_ppm(double fee) {
+    check(fee >= 0 && fee * (double) FEE_PPM_SCALE <= (double) UINT32_MAX,
+        "The fee is out of the supported range");
+
+    return (uint32_t)(fee * (double) FEE_PPM_SCALE + 0.5);
+};
+
+
+/**
+* Calculates the share of an amount for a fee given in parts per million, rounding down
+*/
+uint64_t apply_fee_ppm(uint64_t amount, uint32_t fee_ppm) {
+    return (uint64_t)((uint128_t) amount * fee_ppm / FEE_PPM_SCALE);
+};
+
+
+/**
+* Calculates the smallest bid that beats the given bid by the minimum bid increase, rounding up
+* The result is capped at the maximum asset amount
+*/
+uint64_t get_next_bid_amount(uint64_t amount, uint32_t minimum_bid_increase_ppm) {
+    uint128_t scaled_amount = (uint128_t) amount * (FEE_PPM_SCALE + minimum_bid_increase_ppm);
+    uint128_t next_amount = (scaled_amount + FEE_PPM_SCALE - 1) / FEE_PPM_SCALE;
+    return (uint64_t) std::min(next_amount, (uint128_t) asset::max_amount);
+};
+
+
+/**
+* Gets the maximum bid that the current bidder of an auction has escrowed
+* Rows without a stored maximum bid have only escrowed the current bid. This also applies to rows that were
+* written with an empty maximum bid, which is stored as an asset with an amount of 0 and no symbol
+*/
+template <typename T>
+asset get_escrowed_bid(const T &auction) {
+    if (!auction.max_bid.has_value()
+        || auction.max_bid.value().symbol != auction.current_bid.symbol
+        || auction.max_bid.value().amount < auction.current_bid.amount) {
+        return auction.current_bid;
+    }
+    return auction.max_bid.value();
+};
+
+
+/**
+* Gets the collection fee of a sale, auction or buyoffer in parts per million
+* Rows that were created before the fee was stored as an integer only have the double column
+*/
+template <typename T>
+uint32_t get_collection_fee_ppm(const T &listing) {
+    return listing.collection_fee_ppm.has_value()
+        ? listing.collection_fee_ppm.value()
+        : fee_to_ppm(listing.collection_fee);
+};
+
+
+/**
+* Combines a listing and a settlement symbol (including their precisions) into a single key
+* that uniquely identifies a symbol pair
+*/
+uint128_t symbol_pair_key(symbol listing_symbol, symbol settlement_symbol) {
+    return ((uint128_t) listing_symbol.raw() << 64) | settlement_symbol.raw();
+};
+
+
+/**
+* Combines a settlement symbol and a price amount into a key that orders sales by symbol and then by price
+*/
+uint128_t sale_price_key(symbol settlement_symbol, uint64_t amount) {
+    return ((uint128_t) settlement_symbol.raw() << 64) | amount;
+};
+
+
+/**
+* Same as sale_price_key, but ordering the sales by their template first
+*/
+checksum256 sale_template_price_key(int32_t template_id, symbol settlement_symbol, uint64_t amount) {
+    return checksum256(std::array <uint128_t, 2> {
+        ((uint128_t) (uint32_t) template_id << 64) | settlement_symbol.raw(),
+        (uint128_t) amount
+    });
+};
+
+
+/**
+* Combines a template, a price symbol and a price amount into a key that orders template buyoffers by
+* template, then by symbol and then by price, starting with the highest price
+*/
+checksum256 template_buyoffer_price_key(uint64_t template_id, symbol price_symbol, uint64_t amount) {
+    return checksum256(std::array <uint128_t, 2> {
+        ((uint128_t) template_id << 64) | price_symbol.raw(),
+        (uint128_t) (UINT64_MAX - amount)
+    });
+};
+
+
+/**
+* Calculates the amount that decreases linearly from start_amount at start_time to end_amount at end_time,
+* rounding up
+* Before start_time the amount is start_amount and after end_time it is end_amount
+*/
+uint64_t get_decayed_amount(
+    uint64_t start_amount,
+    uint64_t end_amount,
+    uint32_t start_time,
+    uint32_t end_time,
+    uint32_t time
+) {
+    if (time <= start_time) {
+        return start_amount;
+    }
+    if (time >= end_time) {
+        return end_amount;
+    }
+
+    uint128_t decrease = (uint128_t) (start_amount - end_amount) * (time - start_time);
+    uint32_t duration = end_time - start_time;
+    return start_amount - (uint64_t) (decrease / duration);
+};
+
+
 CONTRACT atomicmarket : public contract {
 public:
     using contract::contract;
 
+    struct SALE_LISTING {
+        vector <uint64_t> asset_ids;
+        asset             listing_price;
+        symbol            settlement_symbol;
+    };
+
+    // The listing price of a dutch sale is its start price
+    // An end time of 0 means that the sale is not a dutch sale
+    struct DUTCH_PRICE {
+        asset    end_price;
+        uint32_t start_time; //seconds since epoch
+        uint32_t end_time;   //seconds since epoch
+    };
+
+    struct SALE_ASSERTION {
+        uint64_t          sale_id;
+        vector <uint64_t> asset_ids;
+        asset             listing_price;
+        symbol            settlement_symbol;
+    };
+
+    struct BUYOFFER_ACCEPTANCE {
+        uint64_t          buyoffer_id;
+        vector <uint64_t> expected_asset_ids;
+        asset             expected_price;
+    };
+
+    struct AUCTION_ASSERTION {
+        uint64_t          auction_id;
+        vector <uint64_t> asset_ids;
+    };
+
+    struct NEW_SALE {
+        uint64_t          sale_id;
+        vector <uint64_t> asset_ids;
+        asset             listing_price;
+        symbol            settlement_symbol;
+        name              collection_name;
+        double            collection_fee;
+    };
+
     ACTION init();
 
     ACTION convcounters();
 
+    ACTION convtokens();
+
+    ACTION convfees();
+
+    ACTION convhashes(
+        name table_name,
+        uint64_t start_id,
+        uint64_t max_rows
+    );
+
+    ACTION convscopes(
+        name table_name,
+        uint64_t max_rows
+    );
+
     ACTION setminbidinc(
         double minimum_bid_increase
     );
@@ -43,6 +288,10 @@ public:
         string new_version
     );
 
+    ACTION setdelphiwin(
+        uint32_t delphi_cache_window
+    );
+
     ACTION addconftoken(
         name token_contract,
         symbol token_symbol
@@ -92,6 +341,25 @@ public:
         asset token_to_withdraw
     );
 
+    ACTION depositram(
+        name account,
+        uint32_t bytes
+    );
+
+    ACTION withdrawram(
+        name account
+    );
+
+    ACTION setrefundopt(
+        name bidder,
+        bool auto_withdraw
+    );
+
+    ACTION pushrefund(
+        name bidder,
+        symbol token_symbol
+    );
+
 
     ACTION announcesale(
         name seller,
@@ -101,10 +369,38 @@ public:
         name maker_marketplace
     );
 
+    ACTION dutchsale(
+        name seller,
+        vector <uint64_t> asset_ids,
+        asset start_price,
+        asset end_price,
+        uint32_t start_time,
+        uint32_t duration,
+        name maker_marketplace
+    );
+
+    ACTION announcebulk(
+        name seller,
+        vector <SALE_LISTING> listings,
+        name maker_marketplace
+    );
+
     ACTION cancelsale(
         uint64_t sale_id
     );
 
+    ACTION setsaleprice(
+        uint64_t sale_id,
+        asset new_listing_price,
+        symbol new_settlement_symbol
+    );
+
+    ACTION sweepsales(
+        name collection_name,
+        uint64_t max_rows,
+        uint64_t cursor
+    );
+
     ACTION purchasesale(
         name buyer,
         uint64_t sale_id,
@@ -112,6 +408,29 @@ public:
         name taker_marketplace
     );
 
+    ACTION purchasemax(
+        name buyer,
+        uint64_t sale_id,
+        asset max_settlement_price,
+        name taker_marketplace
+    );
+
+    ACTION purchasecart(
+        name buyer,
+        vector <uint64_t> sale_ids,
+        name taker_marketplace
+    );
+
+    ACTION sweepfloor(
+        name buyer,
+        name collection_name,
+        int32_t template_id,
+        uint64_t max_count,
+        asset max_total,
+        uint64_t max_rows,
+        name taker_marketplace
+    );
+
     ACTION assertsale(
         uint64_t sale_id,
         vector <uint64_t> asset_ids_to_assert,
@@ -119,6 +438,10 @@ public:
         symbol settlement_symbol_to_assert
     );
 
+    ACTION assertsales(
+        vector <SALE_ASSERTION> sale_assertions
+    );
+
 
     ACTION announceauct(
         name seller,
@@ -139,6 +462,13 @@ public:
         name taker_marketplace
     );
 
+    ACTION auctproxybid(
+        name bidder,
+        uint64_t auction_id,
+        asset max_bid,
+        name taker_marketplace
+    );
+
     ACTION auctclaimbuy(
         uint64_t auction_id
     );
@@ -147,11 +477,25 @@ public:
         uint64_t auction_id
     );
 
+    ACTION auctsettle(
+        uint64_t auction_id
+    );
+
     ACTION assertauct(
         uint64_t auction_id,
         vector <uint64_t> asset_ids_to_assert
     );
 
+    ACTION assertaucts(
+        vector <AUCTION_ASSERTION> auction_assertions
+    );
+
+    ACTION settleaucts(
+        name collection_name,
+        uint64_t max_rows,
+        uint64_t start_after_id
+    );
+
 
     ACTION createbuyo(
         name buyer,
@@ -178,6 +522,16 @@ public:
         string decline_memo
     );
 
+    ACTION acceptbuyos(
+        vector <BUYOFFER_ACCEPTANCE> buyoffer_acceptances,
+        name taker_marketplace
+    );
+
+    ACTION declinebuyos(
+        vector <uint64_t> buyoffer_ids,
+        string decline_memo
+    );
+
     /**
      * Create a buy offer for a template. The balance of the buyer must hold enough to cover the
      * price. Ideally a frontend ensures this and adds a transfer action of the asset if required.
@@ -222,6 +576,13 @@ public:
         name taker_marketplace
     );
 
+    ACTION selltobest(
+        name seller,
+        uint64_t asset_id,
+        asset min_price,
+        name taker_marketplace
+    );
+
     ACTION paysaleram(
         name payer,
         uint64_t sale_id
@@ -272,6 +633,25 @@ public:
         double collection_fee
     );
 
+    ACTION lognewsales(
+        name seller,
+        name maker_marketplace,
+        vector <NEW_SALE> sales
+    );
+
+    ACTION lognewdutch(
+        uint64_t sale_id,
+        name seller,
+        vector <uint64_t> asset_ids,
+        asset start_price,
+        asset end_price,
+        uint32_t start_time,
+        uint32_t end_time,
+        name maker_marketplace,
+        name collection_name,
+        double collection_fee
+    );
+
     ACTION lognewauct(
         uint64_t auction_id,
         name seller,
@@ -315,6 +695,17 @@ public:
         uint64_t auction_id
     );
 
+    ACTION logsaleprice(
+        uint64_t sale_id,
+        asset listing_price,
+        symbol settlement_symbol
+    );
+
+    ACTION logsalesweep(
+        uint64_t swept_sales,
+        uint64_t next_cursor
+    );
+
 private:
     struct COUNTER_RANGE {
         name counter_name;
@@ -334,6 +725,53 @@ private:
         bool   invert_delphi_pair;
     };
 
+    struct FLOOR {
+        uint64_t sale_id;
+        asset    price;
+    };
+
+    struct FEE_PAYOUT {
+        name     recipient;
+        uint64_t amount;
+    };
+
+    // The totals of purchasing multiple sales at once
+    struct CART {
+        vector <asset>                  buyer_total;
+        std::map <name, vector <asset>> fee_totals;
+        std::map <name, vector <asset>> seller_totals;
+        vector <uint64_t>               asset_ids;
+    };
+
+
+public:
+    // The tables are public so that the native tests can serialize their rows
+    TABLE tokens_s {
+        name   token_contract;
+        symbol token_symbol;
+
+        uint64_t primary_key() const { return token_symbol.code().raw(); };
+    };
+
+    typedef multi_index <name("tokens"), tokens_s> tokens_t;
+
+
+    TABLE symbolpairs_s {
+        uint64_t symbol_pair_id;
+        symbol   listing_symbol;
+        symbol   settlement_symbol;
+        name     delphi_pair_name;
+        bool     invert_delphi_pair;
+
+        uint64_t primary_key() const { return symbol_pair_id; };
+
+        uint128_t by_symbols() const { return symbol_pair_key(listing_symbol, settlement_symbol); };
+    };
+
+    typedef multi_index <name("symbolpairs"), symbolpairs_s,
+        indexed_by < name("symbols"), const_mem_fun < symbolpairs_s, uint128_t, &symbolpairs_s::by_symbols>>>
+    symbolpairs_t;
+
 
     TABLE balances_s {
         name           owner;
@@ -345,62 +783,168 @@ private:
     typedef multi_index <name("balances"), balances_s> balances_t;
 
 
+    // RAM that an account has prepaid for listing sales and auctions with a memo
+    // The padding only takes up the deposited bytes, which are freed again as listings are created
+    TABLE ramdeposits_s {
+        name             account;
+        vector <uint8_t> padding;
+
+        uint64_t primary_key() const { return account.value; };
+    };
+
+    typedef multi_index <name("ramdeposits"), ramdeposits_s> ramdeposits_t;
+
+
+    // Bidders whose balance anyone can withdraw to them with pushrefund, e.g. after they were outbid
+    TABLE refundopts_s {
+        name bidder;
+
+        uint64_t primary_key() const { return bidder.value; };
+    };
+
+    typedef multi_index <name("refundopts"), refundopts_s> refundopts_t;
+
+
     TABLE sales_s {
-        uint64_t          sale_id;
-        name              seller;
-        vector <uint64_t> asset_ids;
-        int64_t           offer_id; //-1 if no offer has been created yet, else the offer id
-        asset             listing_price;
-        symbol            settlement_symbol;
-        name              maker_marketplace;
-        name              collection_name;
-        double            collection_fee;
+        uint64_t                       sale_id;
+        name                           seller;
+        vector <uint64_t>              asset_ids;
+        int64_t                        offer_id; //-1 if no offer has been created yet, else the offer id
+        asset                          listing_price;
+        symbol                         settlement_symbol;
+        name                           maker_marketplace;
+        name                           collection_name;
+        double                         collection_fee;
+        binary_extension <uint32_t>    collection_fee_ppm;
+        binary_extension <checksum256> asset_ids_hash;
+        binary_extension <int32_t>     template_id; // -1 for bundles and assets without a template
+        // CDT serializes an empty binary extension as its default value, so every sale that is written again
+        // stores a DUTCH_PRICE. Only an end time other than 0 makes a sale a dutch sale
+        binary_extension <DUTCH_PRICE> dutch_price;
 
         uint64_t primary_key() const { return sale_id; };
 
-        checksum256 asset_ids_hash() const { return hash_asset_ids(asset_ids); };
+        bool is_dutch() const {
+            return dutch_price.has_value() && dutch_price.value().end_time != 0;
+        };
+
+        // Only rows created before the hash was stored need to hash their asset ids
+        checksum256 by_asset_ids_hash() const {
+            return asset_ids_hash.has_value() ? asset_ids_hash.value() : hash_asset_ids(asset_ids);
+        };
+
+        // Bundles and rows created before the hash was stored use 0. The index still stores an entry for them
+        uint64_t by_asset_id() const {
+            return asset_ids_hash.has_value() && asset_ids.size() == 1 ? asset_ids[0] : 0;
+        };
+
+        // Sales using a delphi pair and dutch sales have a price that changes without the row being written
+        bool has_fixed_price() const {
+            return listing_price.symbol == settlement_symbol && !is_dutch();
+        };
+
+        // Sales without a fixed price and sales that are not active yet are ordered after the others
+        uint64_t get_price_amount() const {
+            if (!has_fixed_price() || offer_id == -1) {
+                return UINT64_MAX;
+            }
+            return listing_price.amount;
+        };
+
+        // The price in the settlement symbol at the given time, for sales that don't use a delphi pair
+        asset get_price_at(uint32_t time) const {
+            if (!is_dutch()) {
+                return listing_price;
+            }
+            const DUTCH_PRICE &dutch = dutch_price.value();
+            return asset(
+                get_decayed_amount(
+                    listing_price.amount,
+                    dutch.end_price.amount,
+                    dutch.start_time,
+                    dutch.end_time,
+                    time
+                ),
+                listing_price.symbol
+            );
+        };
+
+        uint128_t by_price() const {
+            return sale_price_key(settlement_symbol, get_price_amount());
+        };
+
+        int32_t get_template_id() const {
+            return template_id.has_value() ? template_id.value() : -1;
+        };
+
+        checksum256 by_template_price() const {
+            return sale_template_price_key(get_template_id(), settlement_symbol, get_price_amount());
+        };
     };
 
     typedef multi_index <name("sales"), sales_s,
-        indexed_by < name("assetidshash"), const_mem_fun < sales_s, checksum256, &sales_s::asset_ids_hash>>>
+        indexed_by < name("assetidshash"), const_mem_fun < sales_s, checksum256, &sales_s::by_asset_ids_hash>>,
+        indexed_by < name("assetid"), const_mem_fun < sales_s, uint64_t, &sales_s::by_asset_id>>,
+        indexed_by < name("price"), const_mem_fun < sales_s, uint128_t, &sales_s::by_price>>,
+        indexed_by < name("templprice"), const_mem_fun < sales_s, checksum256, &sales_s::by_template_price>>>
     sales_t;
 
 
     TABLE auctions_s {
-        uint64_t          auction_id;
-        name              seller;
-        vector <uint64_t> asset_ids;
-        uint32_t          end_time;   //seconds since epoch
-        bool              assets_transferred;
-        asset             current_bid;
-        name              current_bidder;
-        bool              claimed_by_seller;
-        bool              claimed_by_buyer;
-        name              maker_marketplace;
-        name              taker_marketplace;
-        name              collection_name;
-        double            collection_fee;
+        uint64_t                       auction_id;
+        name                           seller;
+        vector <uint64_t>              asset_ids;
+        uint32_t                       end_time;   //seconds since epoch
+        bool                           assets_transferred;
+        asset                          current_bid;
+        name                           current_bidder;
+        bool                           claimed_by_seller;
+        bool                           claimed_by_buyer;
+        name                           maker_marketplace;
+        name                           taker_marketplace;
+        name                           collection_name;
+        double                         collection_fee;
+        binary_extension <uint32_t>    collection_fee_ppm;
+        binary_extension <checksum256> asset_ids_hash;
+        binary_extension <asset>       max_bid;
 
         uint64_t primary_key() const { return auction_id; };
 
-        checksum256 asset_ids_hash() const { return hash_asset_ids(asset_ids); };
+        // Only rows created before the hash was stored need to hash their asset ids
+        checksum256 by_asset_ids_hash() const {
+            return asset_ids_hash.has_value() ? asset_ids_hash.value() : hash_asset_ids(asset_ids);
+        };
+
+        // Bundles and rows created before the hash was stored use 0. The index still stores an entry for them
+        uint64_t by_asset_id() const {
+            return asset_ids_hash.has_value() && asset_ids.size() == 1 ? asset_ids[0] : 0;
+        };
+
+        // Rows created before the hash was stored are not part of the end time index either and use 0,
+        // so that bids, which extend the end time, don't need to update the index for them
+        uint64_t by_end_time() const {
+            return asset_ids_hash.has_value() ? end_time : 0;
+        };
     };
 
     typedef multi_index <name("auctions"), auctions_s,
-        indexed_by < name("assetidshash"), const_mem_fun < auctions_s, checksum256, &auctions_s::asset_ids_hash>>>
+        indexed_by < name("assetidshash"), const_mem_fun < auctions_s, checksum256, &auctions_s::by_asset_ids_hash>>,
+        indexed_by < name("assetid"), const_mem_fun < auctions_s, uint64_t, &auctions_s::by_asset_id>>,
+        indexed_by < name("endtime"), const_mem_fun < auctions_s, uint64_t, &auctions_s::by_end_time>>>
     auctions_t;
 
 
     TABLE buyoffers_s {
-        uint64_t          buyoffer_id;
-        name              buyer;
-        name              recipient;
-        asset             price;
-        vector <uint64_t> asset_ids;
-        string            memo;
-        name              maker_marketplace;
-        name              collection_name;
-        double            collection_fee;
+        uint64_t                    buyoffer_id;
+        name                        buyer;
+        name                        recipient;
+        asset                       price;
+        vector <uint64_t>           asset_ids;
+        string                      memo;
+        name                        maker_marketplace;
+        name                        collection_name;
+        double                      collection_fee;
+        binary_extension <uint32_t> collection_fee_ppm;
 
         uint64_t primary_key() const { return buyoffer_id; };
     };
@@ -411,18 +955,39 @@ private:
      * Buy offers based on a template
      */
     TABLE template_buyoffer_s {
-        uint64_t buyoffer_id;
-        name     buyer;
-        asset    price;
-        uint64_t template_id;
-        name     maker_marketplace;
-        name     collection_name;
-        double   collection_fee;
+        uint64_t                    buyoffer_id;
+        name                        buyer;
+        asset                       price;
+        uint64_t                    template_id;
+        name                        maker_marketplace;
+        name                        collection_name;
+        double                      collection_fee;
+        binary_extension <uint32_t> collection_fee_ppm;
 
         uint64_t primary_key() const { return buyoffer_id; };
+
+        checksum256 by_template_price() const {
+            return template_buyoffer_price_key(template_id, price.symbol, price.amount);
+        };
+    };
+
+    typedef multi_index <name("tbuyoffers"), template_buyoffer_s,
+        indexed_by < name("templprice"), const_mem_fun < template_buyoffer_s, checksum256,
+            &template_buyoffer_s::by_template_price>>>
+    template_buyoffers_t;
+
+
+    // Sales, auctions, buyoffers and template buyoffers are scoped by their collection
+    // The locators (scoped by sale, auction, buyoffer or tbuyoffer) store the scope of each id
+    // Rows created before the tables were scoped are in the scope of the contract and have no locator
+    TABLE locators_s {
+        uint64_t id;
+        name     collection_name;
+
+        uint64_t primary_key() const { return id; };
     };
 
-    typedef multi_index <name("tbuyoffers"), template_buyoffer_s> template_buyoffers_t;
+    typedef multi_index <name("locators"), locators_s> locators_t;
 
 
     TABLE marketplaces_s {
@@ -435,6 +1000,35 @@ private:
     typedef multi_index <name("marketplaces"), marketplaces_s> marketplaces_t;
 
 
+    /**
+     * The last delphi median that was read from the delphioracle for a pair, reused for all purchases
+     * within the delphi cache window
+     */
+    TABLE delphicache_s {
+        name     delphi_pair_name;
+        uint64_t median;
+        uint64_t quoted_precision;
+        uint32_t updated_at; //seconds since epoch
+
+        uint64_t primary_key() const { return delphi_pair_name.value; };
+    };
+
+    typedef multi_index <name("delphicache"), delphicache_s> delphicache_t;
+
+
+    // Scoped by collection
+    // The floors are the cheapest active sales of the template (or of the whole collection for the template -1)
+    // for each settlement symbol. Sales using a delphi pair and dutch sales are not included
+    TABLE floors_s {
+        int32_t        template_id;
+        vector <FLOOR> floors;
+
+        uint64_t primary_key() const { return (uint32_t) template_id; };
+    };
+
+    typedef multi_index <name("floors"), floors_s> floors_t;
+
+
     TABLE counters_s {
         name     counter_name;
         uint64_t counter_value;
@@ -446,11 +1040,12 @@ private:
 
 
     TABLE bonusfees_s {
-        uint64_t               bonusfee_id;
-        name                   fee_recipient;
-        double                 fee;
-        vector <COUNTER_RANGE> counter_ranges;
-        string                 fee_name;
+        uint64_t                    bonusfee_id;
+        name                        fee_recipient;
+        double                      fee;
+        vector <COUNTER_RANGE>      counter_ranges;
+        string                      fee_name;
+        binary_extension <uint32_t> fee_ppm;
 
         uint64_t primary_key() const { return bonusfee_id; };
     };
@@ -459,50 +1054,123 @@ private:
 
 
     TABLE config_s {
-        string              version                  = "1.3.3";
-        uint64_t            sale_counter             = 0; // deprecated and no longer used
-        uint64_t            auction_counter          = 0; // deprecated and no longer used
-        double              minimum_bid_increase     = 0.1;
-        uint32_t            minimum_auction_duration = 120; //2 minutes
-        uint32_t            maximum_auction_duration = 2592000; //30 days
-        uint32_t            auction_reset_duration   = 120; //2 minutes
-        vector <TOKEN>      supported_tokens         = {};
-        vector <SYMBOLPAIR> supported_symbol_pairs   = {};
-        double              maker_market_fee         = 0.01;
-        double              taker_market_fee         = 0.01;
-        name                atomicassets_account     = atomicassets::ATOMICASSETS_ACCOUNT;
-        name                delphioracle_account     = delphioracle::DELPHIORACLE_ACCOUNT;
+        string                      version                  = "1.3.3";
+        uint64_t                    sale_counter             = 0; // deprecated and no longer used
+        uint64_t                    auction_counter          = 0; // deprecated and no longer used
+        double                      minimum_bid_increase     = 0.1;
+        uint32_t                    minimum_auction_duration = 120; //2 minutes
+        uint32_t                    maximum_auction_duration = 2592000; //30 days
+        uint32_t                    auction_reset_duration   = 120; //2 minutes
+        vector <TOKEN>              supported_tokens         = {}; // deprecated and no longer used
+        vector <SYMBOLPAIR>         supported_symbol_pairs   = {}; // deprecated and no longer used
+        double                      maker_market_fee         = 0.01;
+        double                      taker_market_fee         = 0.01;
+        name                        atomicassets_account     = atomicassets::ATOMICASSETS_ACCOUNT;
+        name                        delphioracle_account     = delphioracle::DELPHIORACLE_ACCOUNT;
+        // The fees above in parts per million. Configs written before these were added only contain
+        // the double values, in which case get_config() derives them
+        binary_extension <uint32_t> minimum_bid_increase_ppm;
+        binary_extension <uint32_t> maker_market_fee_ppm;
+        binary_extension <uint32_t> taker_market_fee_ppm;
+        binary_extension <uint32_t> delphi_cache_window; //seconds
     };
     typedef singleton <name("config"), config_s>               config_t;
     // https://github.com/EOSIO/eosio.cdt/issues/280
     typedef multi_index <name("config"), config_s>             config_t_for_abi;
 
 
-    sales_t        sales        = sales_t(get_self(), get_self().value);
-    auctions_t     auctions     = auctions_t(get_self(), get_self().value);
-    buyoffers_t    buyoffers    = buyoffers_t(get_self(), get_self().value);
-    template_buyoffers_t template_buyoffers = template_buyoffers_t(get_self(), get_self().value);
+private:
+    tokens_t       tokens       = tokens_t(get_self(), get_self().value);
+    symbolpairs_t  symbolpairs  = symbolpairs_t(get_self(), get_self().value);
     balances_t     balances     = balances_t(get_self(), get_self().value);
+    ramdeposits_t  ramdeposits  = ramdeposits_t(get_self(), get_self().value);
+    refundopts_t   refundopts   = refundopts_t(get_self(), get_self().value);
     marketplaces_t marketplaces = marketplaces_t(get_self(), get_self().value);
+    delphicache_t  delphicache  = delphicache_t(get_self(), get_self().value);
     counters_t     counters     = counters_t(get_self(), get_self().value);
     bonusfees_t    bonusfees    = bonusfees_t(get_self(), get_self().value);
     config_t       config       = config_t(get_self(), get_self().value);
 
+    // A new contract instance is created for every action, so this copy of the config singleton
+    // is loaded at most once per action and can never be stale
+    std::optional <config_s> cached_config;
+
+    // The scoped tables that were used in this action, by scope
+    std::map <uint64_t, sales_t>              sales_tables;
+    std::map <uint64_t, auctions_t>           auctions_tables;
+    std::map <uint64_t, buyoffers_t>          buyoffers_tables;
+    std::map <uint64_t, template_buyoffers_t> template_buyoffers_tables;
+
+
+    const config_s &get_config();
+
+    void set_config(const config_s &new_config);
+
+
+    sales_t &get_sales(name scope);
+
+    auctions_t &get_auctions(name scope);
+
+    buyoffers_t &get_buyoffers(name scope);
+
+    template_buyoffers_t &get_template_buyoffers(name scope);
+
+    name get_listing_scope(name listing_type, uint64_t listing_id);
+
+    sales_t &locate_sales(uint64_t sale_id);
+
+    auctions_t &locate_auctions(uint64_t auction_id);
+
+    buyoffers_t &locate_buyoffers(uint64_t buyoffer_id);
+
+    template_buyoffers_t &locate_template_buyoffers(uint64_t buyoffer_id);
+
+    void add_locator(name listing_type, uint64_t listing_id, name collection_name, name ram_payer);
+
+    void set_locator_payer(name listing_type, uint64_t listing_id, name ram_payer);
+
+    void remove_locator(name listing_type, uint64_t listing_id);
+
 
     name get_collection_and_check_assets(name owner, vector <uint64_t> asset_ids);
 
+    name get_collection_and_check_assets(const atomicassets::assets_t &owner_assets, vector <uint64_t> asset_ids);
+
+    name get_collection_of_assets(const atomicassets::assets_t &owner_assets, const vector <uint64_t> &asset_ids);
+
+    const atomicassets::collections_s &get_collection(name collection_name);
+
     name get_collection_author(name collection_name);
 
     double get_collection_fee(name collection_name);
 
 
-    uint64_t consume_counter(name counter_name);
+    uint64_t consume_counter(name counter_name, uint64_t amount = 1);
+
+    template <typename T, typename Predicate>
+    typename T::const_iterator find_listing_by_assets(
+        const T &table,
+        const vector <uint64_t> &asset_ids,
+        bool include_unconverted_rows,
+        Predicate predicate
+    );
 
 
     name require_get_supported_token_contract(symbol token_symbol);
 
     SYMBOLPAIR require_get_symbol_pair(symbol listing_symbol, symbol settlement_symbol);
 
+    delphicache_s get_delphi_cache(name delphi_pair_name, bool use_latest_datapoint = false);
+
+    bool is_recent_delphi_median(name delphi_pair_name, uint64_t delphi_median);
+
+    asset get_delphi_settlement_price(
+        asset listing_price,
+        SYMBOLPAIR symbol_pair,
+        uint64_t delphi_median,
+        uint64_t quoted_precision
+    );
+
 
     bool is_token_supported(name token_contract, symbol token_symbol);
 
@@ -519,22 +1187,156 @@ private:
         string memo
     );
 
+    vector <FEE_PAYOUT> get_fee_payouts(
+        asset quantity,
+        name maker_marketplace,
+        name taker_marketplace,
+        name collection_author,
+        uint32_t collection_fee_ppm,
+        name relevant_counter_name,
+        uint64_t relevant_counter_id
+    );
+
     void internal_payout_sale(
         asset quantity,
         name seller,
         name maker_marketplace,
         name taker_marketplace,
         name collection_author,
-        double collection_fee,
+        uint32_t collection_fee_ppm,
         name relevant_counter_name,
         uint64_t relevant_counter_id,
         string seller_payout_message
     );
 
+    void check_sale_price(asset listing_price, symbol settlement_symbol);
+
+    NEW_SALE internal_create_sale(
+        name seller,
+        const atomicassets::assets_t &seller_assets,
+        name assets_collection_name,
+        vector <uint64_t> asset_ids,
+        asset listing_price,
+        symbol settlement_symbol,
+        name maker_marketplace,
+        uint64_t sale_id,
+        int64_t offer_id,
+        const std::optional <DUTCH_PRICE> &dutch_price
+    );
+
+    uint64_t internal_create_auction(
+        name seller,
+        name assets_collection_name,
+        vector <uint64_t> asset_ids,
+        asset starting_bid,
+        uint32_t duration,
+        name maker_marketplace,
+        bool assets_transferred
+    );
+
+    void use_ram_deposit(name account, uint64_t bytes);
+
+    void internal_assert_sale(
+        uint64_t sale_id,
+        const vector <uint64_t> &asset_ids_to_assert,
+        asset listing_price_to_assert,
+        symbol settlement_symbol_to_assert
+    );
+
+    void internal_assert_auction(uint64_t auction_id, const vector <uint64_t> &asset_ids_to_assert);
+
+    void internal_fulfill_template_buyoffer(
+        name seller,
+        template_buyoffers_t &template_buyoffers,
+        template_buyoffers_t::const_iterator buyoffer_itr,
+        uint64_t asset_id,
+        name taker_marketplace
+    );
+
+    void internal_purchase_sale(
+        name buyer,
+        sales_t &sales,
+        sales_t::const_iterator sale_itr,
+        asset sale_price,
+        name taker_marketplace
+    );
+
+    bool is_sale_invalid(const sales_s &sale);
+
+    sales_t::const_iterator internal_remove_sale(sales_t &sales, sales_t::const_iterator sale_itr);
+
+    void internal_place_bid(
+        name bidder,
+        auctions_t &auctions,
+        auctions_t::const_iterator auction_itr,
+        asset bid,
+        asset max_bid,
+        name taker_marketplace
+    );
+
+    void internal_payout_auction(const auctions_s &auction);
+
+    void internal_settle_auction(auctions_t &auctions, auctions_t::const_iterator auction_itr);
+
     void internal_add_balance(name owner, asset quantity);
 
+    void internal_add_balances(name owner, vector <asset> quantities_to_add);
+
     void internal_decrease_balance(name owner, asset quantity);
 
+    void internal_decrease_balances(name owner, vector <asset> quantities_to_decrease);
+
+    void add_to_quantities(vector <asset> &quantities, asset quantity);
+
+    void add_to_cart(
+        CART &cart,
+        name buyer,
+        sales_t &sales,
+        sales_t::const_iterator sale_itr,
+        name taker_marketplace
+    );
+
+    void add_payout_to_cart(
+        CART &cart,
+        asset quantity,
+        name seller,
+        name maker_marketplace,
+        name taker_marketplace,
+        name collection_author,
+        uint32_t collection_fee_ppm,
+        name relevant_counter_name,
+        uint64_t relevant_counter_id
+    );
+
+    void settle_cart(
+        const CART &cart,
+        name buyer,
+        string seller_payout_memo,
+        string asset_transfer_memo
+    );
+
+    void pay_out_cart(const CART &cart, string seller_payout_memo);
+
+    void fill_extensions(sales_s &sale);
+
+    void fill_extensions(auctions_s &auction);
+
+    void fill_extensions(buyoffers_s &buyoffer);
+
+    void fill_extensions(template_buyoffer_s &buyoffer);
+
+    void fill_extensions(bonusfees_s &bonusfee);
+
+    int32_t get_template_id_of_listing(name owner, const vector <uint64_t> &asset_ids);
+
+    int32_t get_template_id_of_listing(const atomicassets::assets_t &owner_assets, const vector <uint64_t> &asset_ids);
+
+    std::optional <FLOOR> find_floor(sales_t &sales, int32_t template_id, symbol settlement_symbol);
+
+    void add_to_floors(const sales_s &sale);
+
+    void remove_from_floors(const sales_s &removed_sale);
+
     void internal_transfer_assets(name to, vector <uint64_t> asset_ids, string memo);
 
 };
@@ -545,7 +1347,7 @@ void apply(uint64_t receiver, uint64_t code, uint64_t action) {
     if (code == receiver) {
         // Since some version of CDT onl 32 actions can be listed here, because of preprocessor
         // magic. From 33 on code doesn't compile.
-        // Hacky solution: Split the switch into two...
+        // Hacky solution: Split the switch into multiple ones...
         // In the old CDT this creates interestingly enough the same WASM, so we can leave it as is
         // to support both CDT versions
         switch (action) {
@@ -561,7 +1363,18 @@ void apply(uint64_t receiver, uint64_t code, uint64_t action) {
         switch(action) {
             EOSIO_DISPATCH_HELPER(atomicmarket, \
             (lognewbuyo)(logsalestart)(logauctstart) \
-            (createtbuyo)(canceltbuyo)(fulfilltbuyo))
+            (createtbuyo)(canceltbuyo)(fulfilltbuyo) \
+            (convtokens)(convfees)(setdelphiwin) \
+            (purchasemax)(announcebulk)(lognewsales)(purchasecart) \
+            (convhashes)(sweepsales)(logsalesweep) \
+            (setsaleprice)(logsaleprice)(convscopes)(sweepfloor) \
+            (assertsales)(assertaucts)(settleaucts)(auctsettle) \
+            (auctproxybid)(dutchsale)(lognewdutch)(acceptbuyos) \
+            (declinebuyos)(selltobest))
+        }
+        switch(action) {
+            EOSIO_DISPATCH_HELPER(atomicmarket, \
+            (depositram)(withdrawram)(setrefundopt)(pushrefund))
         }
     } else if (code == atomicassets::ATOMICASSETS_ACCOUNT.value && action == name("transfer").value) {
         eosio::execute_action(name(receiver), name(code), &atomicmarket::receive_asset_transfer);
@@ -0,0 +1,122 @@
+/*
+
+Integer conversion of prices denoted in a delphioracle listing symbol into a settlement token.
+
+It does not depend on any contract state, so it can be tested against the previous floating point
+formula without deploying the contract.
+
+*/
+
+
+#include <eosio/eosio.hpp>
+
+#include <array>
+
+using namespace eosio;
+using namespace std;
+
+namespace delphiconversion {
+
+    enum rounding_mode : uint8_t {
+        ROUND_DOWN = 0,
+        ROUND_UP   = 1
+    };
+
+    // 10^38 is the largest power of ten that fits into an uint128_t
+    static constexpr int32_t MAX_POW10_EXPONENT = 38;
+
+    constexpr array <uint128_t, MAX_POW10_EXPONENT + 1> make_pow10_table() {
+        array <uint128_t, MAX_POW10_EXPONENT + 1> table = {};
+        uint128_t value = 1;
+        for (int32_t i = 0; i <= MAX_POW10_EXPONENT; i++) {
+            table[i] = value;
+            value *= 10;
+        }
+        return table;
+    }
+
+    static constexpr array <uint128_t, MAX_POW10_EXPONENT + 1> POW10 = make_pow10_table();
+
+
+    uint128_t get_pow10(int32_t exponent) {
+        check(exponent >= 0 && exponent <= MAX_POW10_EXPONENT,
+            "The precisions of the delphi pair can not be converted");
+        return POW10[exponent];
+    }
+
+    uint128_t checked_mul(uint128_t a, uint128_t b) {
+        check(a == 0 || b <= (~(uint128_t) 0) / a,
+            "The converted price is too large");
+        return a * b;
+    }
+
+    uint128_t divide(uint128_t numerator, uint128_t denominator, rounding_mode rounding) {
+        uint128_t quotient = numerator / denominator;
+        if (rounding == ROUND_UP && numerator % denominator != 0) {
+            quotient++;
+        }
+        return quotient;
+    }
+
+
+    /**
+    * Gets the exponent of the power of ten that the converted price needs to be scaled by, which is
+    * derived from the precisions of the listing symbol, the settlement symbol and the delphi pair
+    */
+    int32_t get_exponent(
+        bool invert_delphi_pair,
+        uint64_t quoted_precision,
+        uint8_t listing_precision,
+        uint8_t settlement_precision
+    ) {
+        check(quoted_precision <= MAX_POW10_EXPONENT,
+            "The quoted precision of the delphi pair is too large");
+
+        int32_t exponent = (int32_t) settlement_precision - (int32_t) listing_precision;
+        return invert_delphi_pair
+            ? exponent - (int32_t) quoted_precision
+            : exponent + (int32_t) quoted_precision;
+    }
+
+
+    /**
+    * Converts an amount in the listing symbol into an amount of the settlement symbol
+    *
+    * Equivalent to the floating point formulas
+    * normal:   listing_amount / median * 10^(quoted_precision + settlement_precision - listing_precision)
+    * inverted: listing_amount * median * 10^(-quoted_precision + settlement_precision - listing_precision)
+    *
+    * but calculated exactly with 128 bit intermediates and a single, explicit rounding step at the end
+    */
+    uint64_t convert_price(
+        uint64_t listing_amount,
+        uint64_t median,
+        bool invert_delphi_pair,
+        uint64_t quoted_precision,
+        uint8_t listing_precision,
+        uint8_t settlement_precision,
+        rounding_mode rounding
+    ) {
+        check(median > 0, "The delphi median must be greater than zero");
+
+        int32_t exponent = get_exponent(invert_delphi_pair, quoted_precision, listing_precision, settlement_precision);
+
+        uint128_t numerator = invert_delphi_pair
+            ? (uint128_t) listing_amount * median
+            : (uint128_t) listing_amount;
+        uint128_t denominator = invert_delphi_pair
+            ? 1
+            : (uint128_t) median;
+
+        if (exponent >= 0) {
+            numerator = checked_mul(numerator, get_pow10(exponent));
+        } else {
+            denominator = checked_mul(denominator, get_pow10(-exponent));
+        }
+
+        uint128_t result = divide(numerator, denominator, rounding);
+
+        check(result <= (uint128_t) asset::max_amount, "The converted price is too large");
+        return (uint64_t) result;
+    }
+}
@@ -0,0 +1,147 @@
+/*
+
+Parsing of the memos that create sales and auctions directly from an atomicassets offer or transfer.
+
+sale:<listing_price>:<settlement_symbol>:<maker_marketplace>
+e.g. sale:10.00000000 WAX:8,WAX:mymarket
+
+auction:<starting_bid>:<duration>:<maker_marketplace>
+e.g. auction:1.00000000 WAX:86400:mymarket
+
+The maker marketplace can be left empty to use the default marketplace.
+
+*/
+
+
+#include <eosio/eosio.hpp>
+#include <eosio/asset.hpp>
+
+using namespace eosio;
+using namespace std;
+
+namespace listingmemo {
+
+    static const string SALE_PREFIX = "sale:";
+    static const string AUCTION_PREFIX = "auction:";
+
+    // The largest precision a symbol can have
+    static constexpr uint8_t MAX_SYMBOL_PRECISION = 18;
+
+    struct SALE_MEMO {
+        asset listing_price;
+        symbol settlement_symbol;
+        name maker_marketplace;
+    };
+
+    struct AUCTION_MEMO {
+        asset starting_bid;
+        uint32_t duration;
+        name maker_marketplace;
+    };
+
+
+    bool has_prefix(const string &memo, const string &prefix) {
+        return memo.compare(0, prefix.size(), prefix) == 0;
+    }
+
+
+    /**
+    * Splits the part of the memo after the prefix at every ':'
+    */
+    vector <string> split_fields(const string &memo, const string &prefix) {
+        vector <string> fields;
+        size_t start = prefix.size();
+        while (true) {
+            size_t end = memo.find(':', start);
+            if (end == string::npos) {
+                fields.push_back(memo.substr(start));
+                return fields;
+            }
+            fields.push_back(memo.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+
+
+    uint64_t parse_uint64(const string &value, uint64_t max_value, const char *error_message) {
+        check(!value.empty() && value.size() <= 20, error_message);
+
+        uint64_t result = 0;
+        for (char c : value) {
+            check(c >= '0' && c <= '9', error_message);
+            uint64_t digit = c - '0';
+            check(result <= (max_value - digit) / 10, error_message);
+            result = result * 10 + digit;
+        }
+        return result;
+    }
+
+
+    /**
+    * Parses a symbol in the form <precision>,<code>, e.g. 8,WAX
+    */
+    symbol parse_symbol(const string &value) {
+        size_t separator = value.find(',');
+        check(separator != string::npos, "Invalid symbol in memo");
+
+        uint64_t precision = parse_uint64(value.substr(0, separator), MAX_SYMBOL_PRECISION,
+            "Invalid symbol precision in memo");
+        symbol_code code = symbol_code(value.substr(separator + 1));
+
+        symbol result = symbol(code, (uint8_t) precision);
+        check(result.is_valid(), "Invalid symbol in memo");
+        return result;
+    }
+
+
+    /**
+    * Parses an asset in the form <amount> <code>, e.g. 10.00000000 WAX
+    * The precision of the asset is given by the number of decimal places of the amount
+    */
+    asset parse_asset(const string &value) {
+        size_t space = value.find(' ');
+        check(space != string::npos, "Invalid asset in memo");
+
+        string amount_string = value.substr(0, space);
+        uint8_t precision = 0;
+        size_t dot = amount_string.find('.');
+        if (dot != string::npos) {
+            check(amount_string.size() - dot - 1 <= MAX_SYMBOL_PRECISION, "Invalid asset precision in memo");
+            precision = amount_string.size() - dot - 1;
+            amount_string.erase(dot, 1);
+        }
+
+        uint64_t amount = parse_uint64(amount_string, asset::max_amount, "Invalid asset amount in memo");
+        symbol_code code = symbol_code(value.substr(space + 1));
+
+        asset result = asset(amount, symbol(code, precision));
+        check(result.is_valid(), "Invalid asset in memo");
+        return result;
+    }
+
+
+    SALE_MEMO parse_sale_memo(const string &memo) {
+        vector <string> fields = split_fields(memo, SALE_PREFIX);
+        check(fields.size() == 3,
+            "Invalid sale memo, expected sale:<listing_price>:<settlement_symbol>:<maker_marketplace>");
+
+        return {
+            .listing_price = parse_asset(fields[0]),
+            .settlement_symbol = parse_symbol(fields[1]),
+            .maker_marketplace = name(fields[2])
+        };
+    }
+
+
+    AUCTION_MEMO parse_auction_memo(const string &memo) {
+        vector <string> fields = split_fields(memo, AUCTION_PREFIX);
+        check(fields.size() == 3,
+            "Invalid auction memo, expected auction:<starting_bid>:<duration>:<maker_marketplace>");
+
+        return {
+            .starting_bid = parse_asset(fields[0]),
+            .duration = (uint32_t) parse_uint64(fields[1], UINT32_MAX, "Invalid auction duration in memo"),
+            .maker_marketplace = name(fields[2])
+        };
+    }
+}
@@ -1,7 +1,5 @@
 #include <atomicmarket.hpp>
 
-#include <math.h>
-
 
 /**
 * Initializes the config table. Only needs to be called once when first deploying the contract
@@ -33,7 +31,7 @@ ACTION atomicmarket::init() {
 ACTION atomicmarket::convcounters() {
     require_auth(get_self());
 
-    config_s current_config = config.get();
+    config_s current_config = get_config();
 
     check(current_config.sale_counter != 0 && current_config.auction_counter != 0,
         "The sale or auction counters have already been converted");
@@ -50,7 +48,256 @@ ACTION atomicmarket::convcounters() {
     });
     current_config.auction_counter = 0;
 
-    config.set(current_config, get_self());
+    set_config(current_config);
+}
+
+
+/**
+* Moves the now deprecated supported tokens and supported symbol pairs in the config singleton
+* into the tokens and symbolpairs tables
+* 
+* Calling this only is necessary when upgrading the contract from a version that stored the supported
+* tokens and symbol pairs in the config singleton
+* When deploying a fresh contract, this action can be ignored completely
+* 
+* @required_auth The contract itself
+*/
+ACTION atomicmarket::convtokens() {
+    require_auth(get_self());
+
+    config_s current_config = get_config();
+
+    check(current_config.supported_tokens.size() != 0 || current_config.supported_symbol_pairs.size() != 0,
+        "The supported tokens and symbol pairs have already been converted");
+
+    for (const TOKEN &supported_token : current_config.supported_tokens) {
+        check(tokens.find(supported_token.token_symbol.code().raw()) == tokens.end(),
+            "A token with this symbol code has already been added to the tokens table");
+
+        tokens.emplace(get_self(), [&](auto &_token) {
+            _token.token_contract = supported_token.token_contract;
+            _token.token_symbol = supported_token.token_symbol;
+        });
+    }
+    current_config.supported_tokens = {};
+
+    for (const SYMBOLPAIR &symbol_pair : current_config.supported_symbol_pairs) {
+        check(!is_symbol_pair_supported(symbol_pair.listing_symbol, symbol_pair.settlement_symbol),
+            "A symbol pair with this listing - settlement symbol combination has already been added");
+
+        symbolpairs.emplace(get_self(), [&](auto &_symbol_pair) {
+            _symbol_pair.symbol_pair_id = symbolpairs.available_primary_key();
+            _symbol_pair.listing_symbol = symbol_pair.listing_symbol;
+            _symbol_pair.settlement_symbol = symbol_pair.settlement_symbol;
+            _symbol_pair.delphi_pair_name = symbol_pair.delphi_pair_name;
+            _symbol_pair.invert_delphi_pair = symbol_pair.invert_delphi_pair;
+        });
+    }
+    current_config.supported_symbol_pairs = {};
+
+    set_config(current_config);
+}
+
+
+/**
+* Stores the market fees, the minimum bid increase and the bonus fees as integers in parts per million
+* next to their deprecated double values
+* 
+* Calling this only is necessary when upgrading the contract from a version that stored these fees
+* only as doubles. Sales, auctions and buyoffers created before that are converted on the fly when
+* they are paid out
+* 
+* @required_auth The contract itself
+*/
+ACTION atomicmarket::convfees() {
+    require_auth(get_self());
+
+    // get_config() already derives the integer fees if they are missing
+    set_config(get_config());
+
+    for (auto bonusfee_itr = bonusfees.begin(); bonusfee_itr != bonusfees.end(); bonusfee_itr++) {
+        if (!bonusfee_itr->fee_ppm.has_value()) {
+            bonusfees.modify(bonusfee_itr, get_self(), [&](auto &_bonusfee) {
+                fill_extensions(_bonusfee);
+            });
+        }
+    }
+}
+
+
+/**
+* Converts up to max_rows sales or auctions (depending on table_name), starting at the row with the id start_id,
+* that were created before the asset ids hash was stored in the rows or before single asset rows were
+* part of the asset id index
+* 
+* Only rows in the scope of the contract can be unconverted, because rows in the collection scopes are
+* created with the hash. convscopes converts the rows as well while moving them to their collection scope
+* 
+* Unconverted rows are not part of all secondary indices, so they can't be modified in place. Until they are
+* converted, they can still be cancelled, bought and settled, but unconverted sales and auctions can't be
+* started, bid on or claimed one side at a time, and unconverted single asset rows are not found by
+* the duplicate checks when announcing sales or auctions
+* 
+* Rows can't be added to a secondary index by modifying them, so the converted rows are erased and emplaced again.
+* The RAM of the converted rows is billed to the contract itself, because the contract can't increase
+* the RAM usage of the sellers without their authorization
+* 
+* @required_auth The contract itself
+*/
+ACTION atomicmarket::convhashes(
+    name table_name,
+    uint64_t start_id,
+    uint64_t max_rows
+) {
+    require_auth(get_self());
+
+    check(max_rows > 0, "max_rows needs to be greater than 0");
+
+    if (table_name == name("sales")) {
+        sales_t &sales = get_sales(get_self());
+
+        uint64_t row_count = 0;
+        auto sale_itr = sales.lower_bound(start_id);
+        while (sale_itr != sales.end() && row_count < max_rows) {
+            if (is_unconverted_listing(*sale_itr)) {
+                sales_s converted_sale = *sale_itr;
+                // Single asset rows might still store the full hash
+                converted_sale.asset_ids_hash = get_stored_asset_ids_hash(converted_sale.asset_ids);
+                fill_extensions(converted_sale);
+
+                sale_itr = sales.erase(sale_itr);
+                sales.emplace(get_self(), [&](auto &_sale) {
+                    _sale = converted_sale;
+                });
+            } else {
+                sale_itr++;
+            }
+            row_count++;
+        }
+
+    } else if (table_name == name("auctions")) {
+        auctions_t &auctions = get_auctions(get_self());
+
+        uint64_t row_count = 0;
+        auto auction_itr = auctions.lower_bound(start_id);
+        while (auction_itr != auctions.end() && row_count < max_rows) {
+            if (is_unconverted_listing(*auction_itr)) {
+                auctions_s converted_auction = *auction_itr;
+                // Single asset rows might still store the full hash
+                converted_auction.asset_ids_hash = get_stored_asset_ids_hash(converted_auction.asset_ids);
+                fill_extensions(converted_auction);
+
+                auction_itr = auctions.erase(auction_itr);
+                auctions.emplace(get_self(), [&](auto &_auction) {
+                    _auction = converted_auction;
+                });
+            } else {
+                auction_itr++;
+            }
+            row_count++;
+        }
+
+    } else {
+        check(false, "table_name needs to be either sales or auctions");
+    }
+}
+
+
+/**
+* Moves up to max_rows sales, auctions, buyoffers or template buyoffers (depending on table_name) that were
+* created before the tables were scoped by collection from the scope of the contract to the scope of
+* their collection and creates their locators
+* 
+* Sales and auctions are converted like in convhashes at the same time, and the template of single asset
+* sales is stored for the template price index
+* 
+* The RAM of the moved rows and the locators is billed to the contract itself, because the contract can't
+* increase the RAM usage of the sellers and buyers without their authorization
+* 
+* @required_auth The contract itself
+*/
+ACTION atomicmarket::convscopes(
+    name table_name,
+    uint64_t max_rows
+) {
+    require_auth(get_self());
+
+    check(max_rows > 0, "max_rows needs to be greater than 0");
+
+    if (table_name == name("sales")) {
+        sales_t &legacy_sales = get_sales(get_self());
+
+        uint64_t row_count = 0;
+        auto sale_itr = legacy_sales.begin();
+        while (sale_itr != legacy_sales.end() && row_count < max_rows) {
+            sales_s moved_sale = *sale_itr;
+            moved_sale.asset_ids_hash = get_stored_asset_ids_hash(moved_sale.asset_ids);
+            fill_extensions(moved_sale);
+
+            sale_itr = legacy_sales.erase(sale_itr);
+            get_sales(moved_sale.collection_name).emplace(get_self(), [&](auto &_sale) {
+                _sale = moved_sale;
+            });
+            add_locator(name("sale"), moved_sale.sale_id, moved_sale.collection_name, get_self());
+            add_to_floors(moved_sale);
+            row_count++;
+        }
+
+    } else if (table_name == name("auctions")) {
+        auctions_t &legacy_auctions = get_auctions(get_self());
+
+        uint64_t row_count = 0;
+        auto auction_itr = legacy_auctions.begin();
+        while (auction_itr != legacy_auctions.end() && row_count < max_rows) {
+            auctions_s moved_auction = *auction_itr;
+            moved_auction.asset_ids_hash = get_stored_asset_ids_hash(moved_auction.asset_ids);
+            fill_extensions(moved_auction);
+
+            auction_itr = legacy_auctions.erase(auction_itr);
+            get_auctions(moved_auction.collection_name).emplace(get_self(), [&](auto &_auction) {
+                _auction = moved_auction;
+            });
+            add_locator(name("auction"), moved_auction.auction_id, moved_auction.collection_name, get_self());
+            row_count++;
+        }
+
+    } else if (table_name == name("buyoffers")) {
+        buyoffers_t &legacy_buyoffers = get_buyoffers(get_self());
+
+        uint64_t row_count = 0;
+        auto buyoffer_itr = legacy_buyoffers.begin();
+        while (buyoffer_itr != legacy_buyoffers.end() && row_count < max_rows) {
+            buyoffers_s moved_buyoffer = *buyoffer_itr;
+            fill_extensions(moved_buyoffer);
+
+            buyoffer_itr = legacy_buyoffers.erase(buyoffer_itr);
+            get_buyoffers(moved_buyoffer.collection_name).emplace(get_self(), [&](auto &_buyoffer) {
+                _buyoffer = moved_buyoffer;
+            });
+            add_locator(name("buyoffer"), moved_buyoffer.buyoffer_id, moved_buyoffer.collection_name, get_self());
+            row_count++;
+        }
+
+    } else if (table_name == name("tbuyoffers")) {
+        template_buyoffers_t &legacy_buyoffers = get_template_buyoffers(get_self());
+
+        uint64_t row_count = 0;
+        auto buyoffer_itr = legacy_buyoffers.begin();
+        while (buyoffer_itr != legacy_buyoffers.end() && row_count < max_rows) {
+            template_buyoffer_s moved_buyoffer = *buyoffer_itr;
+            fill_extensions(moved_buyoffer);
+
+            buyoffer_itr = legacy_buyoffers.erase(buyoffer_itr);
+            get_template_buyoffers(moved_buyoffer.collection_name).emplace(get_self(), [&](auto &_buyoffer) {
+                _buyoffer = moved_buyoffer;
+            });
+            add_locator(name("tbuyoffer"), moved_buyoffer.buyoffer_id, moved_buyoffer.collection_name, get_self());
+            row_count++;
+        }
+
+    } else {
+        check(false, "table_name needs to be either sales, auctions, buyoffers or tbuyoffers");
+    }
 }
 
 
@@ -63,9 +310,10 @@ ACTION atomicmarket::setminbidinc(double minimum_bid_increase) {
     require_auth(get_self());
     check(minimum_bid_increase > 0, "The bid increase must be greater than 0");
 
-    config_s current_config = config.get();
+    config_s current_config = get_config();
     current_config.minimum_bid_increase = minimum_bid_increase;
-    config.set(current_config, get_self());
+    current_config.minimum_bid_increase_ppm = fee_to_ppm(minimum_bid_increase);
+    set_config(current_config);
 }
 
 
@@ -77,33 +325,46 @@ ACTION atomicmarket::setminbidinc(double minimum_bid_increase) {
 ACTION atomicmarket::setversion(string new_version) {
     require_auth(get_self());
 
-    config_s current_config = config.get();
+    config_s current_config = get_config();
     current_config.version = new_version;
 
-    config.set(current_config, get_self());
+    set_config(current_config);
 }
 
 
 /**
-* Adds a token that can be used to sell assets for
+* Sets the number of seconds for which a delphi median is cached and reused by purchases
+* The window is limited to MAX_DELPHI_CACHE_WINDOW seconds
 * 
 * @required_auth The contract itself
 */
-ACTION atomicmarket::addconftoken(name token_contract, symbol token_symbol) {
+ACTION atomicmarket::setdelphiwin(uint32_t delphi_cache_window) {
     require_auth(get_self());
 
-    check(!is_symbol_supported(token_symbol),
-        "A token with this symbol is already supported");
+    check(delphi_cache_window <= MAX_DELPHI_CACHE_WINDOW,
+        "The delphi cache window can't be longer than 300 seconds");
+
+    config_s current_config = get_config();
+    current_config.delphi_cache_window = delphi_cache_window;
+    set_config(current_config);
+}
+
 
+/**
+* Adds a token that can be used to sell assets for
+* 
+* @required_auth The contract itself
+*/
+ACTION atomicmarket::addconftoken(name token_contract, symbol token_symbol) {
+    require_auth(get_self());
 
-    config_s current_config = config.get();
+    check(tokens.find(token_symbol.code().raw()) == tokens.end(),
+        "A token with this symbol code is already supported");
 
-    current_config.supported_tokens.push_back({
-        .token_contract = token_contract,
-        .token_symbol = token_symbol
+    tokens.emplace(get_self(), [&](auto &_token) {
+        _token.token_contract = token_contract;
+        _token.token_symbol = token_symbol;
     });
-
-    config.set(current_config, get_self());
 }
 
 
@@ -145,17 +406,13 @@ ACTION atomicmarket::adddelphi(
 
     check(is_symbol_supported(settlement_symbol), "The settlement symbol does not belong to a supported token");
 
-
-    config_s current_config = config.get();
-
-    current_config.supported_symbol_pairs.push_back({
-        .listing_symbol = listing_symbol,
-        .settlement_symbol = settlement_symbol,
-        .delphi_pair_name = delphi_pair_name,
-        .invert_delphi_pair = invert_delphi_pair
+    symbolpairs.emplace(get_self(), [&](auto &_symbol_pair) {
+        _symbol_pair.symbol_pair_id = symbolpairs.available_primary_key();
+        _symbol_pair.listing_symbol = listing_symbol;
+        _symbol_pair.settlement_symbol = settlement_symbol;
+        _symbol_pair.delphi_pair_name = delphi_pair_name;
+        _symbol_pair.invert_delphi_pair = invert_delphi_pair;
     });
-
-    config.set(current_config, get_self());
 }
 
 
@@ -170,12 +427,14 @@ ACTION atomicmarket::setmarketfee(double maker_market_fee, double taker_market_f
     check(maker_market_fee >= 0 && taker_market_fee >= 0,
         "Market fees need to be at least 0");
 
-    config_s current_config = config.get();
+    config_s current_config = get_config();
 
     current_config.maker_market_fee = maker_market_fee;
     current_config.taker_market_fee = taker_market_fee;
+    current_config.maker_market_fee_ppm = fee_to_ppm(maker_market_fee);
+    current_config.taker_market_fee_ppm = fee_to_ppm(taker_market_fee);
 
-    config.set(current_config, get_self());
+    set_config(current_config);
 }
 
 
@@ -217,6 +476,7 @@ ACTION atomicmarket::addbonusfee(
         _bonusfee.fee = fee;
         _bonusfee.counter_ranges = counter_ranges;
         _bonusfee.fee_name = fee_name;
+        _bonusfee.fee_ppm = fee_to_ppm(fee);
     });
 }
 
@@ -262,6 +522,7 @@ ACTION atomicmarket::addafeectr(
 
     bonusfees.modify(bonusfee_itr, get_self(), [&](auto &_bonusfee) {
         _bonusfee.counter_ranges = counter_ranges;
+        fill_extensions(_bonusfee);
     });
 }
 
@@ -288,6 +549,7 @@ ACTION atomicmarket::stopbonusfee(
 
     bonusfees.modify(bonusfee_itr, get_self(), [&](auto &_bonusfee) {
         _bonusfee.counter_ranges = counter_ranges;
+        fill_extensions(_bonusfee);
     });
 }
 
@@ -371,6 +633,117 @@ ACTION atomicmarket::withdraw(
 }
 
 
+/**
+* Prepays RAM for listing sales and auctions with a memo
+* 
+* A listing that is created with a memo is created in an atomicassets notification, in which only the
+* contract itself could be billed for new RAM. The RAM of the listing is billed to the seller instead,
+* and at least as many bytes of the seller's deposit are freed at the same time, so that the RAM usage
+* of the seller does not increase
+* 
+* @required_auth account
+*/
+ACTION atomicmarket::depositram(
+    name account,
+    uint32_t bytes
+) {
+    require_auth(account);
+
+    check(bytes > 0, "bytes needs to be greater than 0");
+
+    auto deposit_itr = ramdeposits.find(account.value);
+    if (deposit_itr == ramdeposits.end()) {
+        check(bytes <= MAX_RAM_DEPOSIT_BYTES, "The RAM deposit can't be larger than 65536 bytes");
+
+        ramdeposits.emplace(account, [&](auto &_deposit) {
+            _deposit.account = account;
+            _deposit.padding = vector <uint8_t>(bytes);
+        });
+    } else {
+        check(deposit_itr->padding.size() + bytes <= MAX_RAM_DEPOSIT_BYTES,
+            "The RAM deposit can't be larger than 65536 bytes");
+
+        ramdeposits.modify(deposit_itr, same_payer, [&](auto &_deposit) {
+            _deposit.padding.resize(_deposit.padding.size() + bytes);
+        });
+    }
+}
+
+
+/**
+* Frees the remaining RAM deposit of an account
+* 
+* @required_auth account
+*/
+ACTION atomicmarket::withdrawram(
+    name account
+) {
+    require_auth(account);
+
+    auto deposit_itr = ramdeposits.require_find(account.value,
+        "The account does not have a RAM deposit");
+
+    ramdeposits.erase(deposit_itr);
+}
+
+
+/**
+* Sets whether anyone may withdraw the balance of the bidder to them with the pushrefund action
+* 
+* Outbid refunds are always added to the bidder's balance, so that a bidder who can't receive tokens
+* can't block other bidders. Withdrawing them for the bidder is a separate action that only fails by itself
+* 
+* @required_auth bidder
+*/
+ACTION atomicmarket::setrefundopt(
+    name bidder,
+    bool auto_withdraw
+) {
+    require_auth(bidder);
+
+    auto refundopt_itr = refundopts.find(bidder.value);
+
+    if (auto_withdraw) {
+        check(refundopt_itr == refundopts.end(), "Automatic withdrawals are already enabled for this bidder");
+
+        refundopts.emplace(bidder, [&](auto &_refundopt) {
+            _refundopt.bidder = bidder;
+        });
+    } else {
+        check(refundopt_itr != refundopts.end(), "Automatic withdrawals are not enabled for this bidder");
+
+        refundopts.erase(refundopt_itr);
+    }
+}
+
+
+/**
+* Withdraws the whole balance of a token of a bidder that has enabled automatic withdrawals to the bidder
+* This can be called by anyone, e.g. by a service that pays for the transaction after the bidder was outbid
+* 
+* @required_auth None
+*/
+ACTION atomicmarket::pushrefund(
+    name bidder,
+    symbol token_symbol
+) {
+    check(refundopts.find(bidder.value) != refundopts.end(),
+        "The bidder has not enabled automatic withdrawals");
+
+    auto balance_itr = balances.require_find(bidder.value,
+        "The bidder does not have a balance");
+
+    for (const asset &quantity : balance_itr->quantities) {
+        if (quantity.symbol == token_symbol) {
+            internal_withdraw_tokens(bidder, quantity, "AtomicMarket Refund Withdrawal");
+            return;
+        }
+    }
+
+    check(false, "The bidder does not have a balance of this token");
+}
+
+
 /**
 * Create a sale listing
 * For the sale to become active, the seller needs to create an atomicassets offer from them to the atomicmarket
@@ -387,73 +760,168 @@ ACTION atomicmarket::announcesale(
 ) {
     require_auth(seller);
 
-    check(listing_price.is_valid(), "Invalid type listing_price");
-    check(settlement_symbol.is_valid(), "Invalid type settlement_symbol");
+    check(is_valid_marketplace(maker_marketplace), "The maker marketplace is not a valid marketplace");
+
+    atomicassets::assets_t seller_assets = atomicassets::get_assets(seller);
 
-    name assets_collection_name = get_collection_and_check_assets(seller, asset_ids);
+    NEW_SALE new_sale = internal_create_sale(
+        seller,
+        seller_assets,
+        get_collection_and_check_assets(seller_assets, asset_ids),
+        asset_ids,
+        listing_price,
+        settlement_symbol,
+        maker_marketplace,
+        consume_counter(name("sale")),
+        -1,
+        std::nullopt
+    );
 
 
-    checksum256 asset_ids_hash = hash_asset_ids(asset_ids);
+    action(
+        permission_level{get_self(), name("active")},
+        get_self(),
+        name("lognewsale"),
+        make_tuple(
+            new_sale.sale_id,
+            seller,
+            new_sale.asset_ids,
+            new_sale.listing_price,
+            new_sale.settlement_symbol,
+            maker_marketplace,
+            new_sale.collection_name,
+            new_sale.collection_fee
+        )
+    ).send();
+}
 
-    auto sales_by_hash = sales.get_index <name("assetidshash")>();
-    auto sale_itr = sales_by_hash.find(asset_ids_hash);
 
-    while (sale_itr != sales_by_hash.end()) {
-        if (asset_ids_hash != sale_itr->asset_ids_hash()) {
-            break;
-        }
+/**
+* Create a dutch sale listing
+* The price of a dutch sale decreases linearly from start_price at start_time to end_price at
+* start_time + duration and then stays at end_price. The current price is calculated when the sale is
+* purchased, so the sale row is never written to update the price
+* 
+* If start_time is 0, the price starts decreasing right away
+* 
+* Like for other sales, the seller needs to create an atomicassets offer with the memo "sale" for the sale
+* to become active
+* 
+* @required_auth seller
+*/
+ACTION atomicmarket::dutchsale(
+    name seller,
+    vector <uint64_t> asset_ids,
+    asset start_price,
+    asset end_price,
+    uint32_t start_time,
+    uint32_t duration,
+    name maker_marketplace
+) {
+    require_auth(seller);
 
-        check(sale_itr->seller != seller,
-            "You have already announced a sale for these assets. You can cancel a sale using the cancelsale action.");
+    check(is_valid_marketplace(maker_marketplace), "The maker marketplace is not a valid marketplace");
 
-        sale_itr++;
-    }
+    check(start_price.is_valid(), "Invalid type start_price");
+    check(end_price.is_valid(), "Invalid type end_price");
+    check(end_price.symbol == start_price.symbol, "The end price must use the same symbol as the start price");
+    check(end_price.amount > 0, "The end price must be greater than zero");
+    check(end_price.amount < start_price.amount, "The end price must be lower than the start price");
 
+    check(duration > 0, "The duration must be greater than zero");
 
-    if (listing_price.symbol == settlement_symbol) {
-        check(is_symbol_supported(listing_price.symbol), "The specified listing symbol is not supported.");
-    } else {
-        check(is_symbol_pair_supported(listing_price.symbol, settlement_symbol),
-            "The specified listing - settlement symbol combination is not supported");
+    if (start_time == 0) {
+        start_time = current_time_point().sec_since_epoch();
     }
+    check(start_time <= UINT32_MAX - duration, "The end time of the dutch sale is too far in the future");
 
+    atomicassets::assets_t seller_assets = atomicassets::get_assets(seller);
 
-    check(listing_price.amount > 0, "The sale price must be greater than zero");
+    NEW_SALE new_sale = internal_create_sale(
+        seller,
+        seller_assets,
+        get_collection_and_check_assets(seller_assets, asset_ids),
+        asset_ids,
+        start_price,
+        start_price.symbol,
+        maker_marketplace,
+        consume_counter(name("sale")),
+        -1,
+        DUTCH_PRICE{
+            .end_price = end_price,
+            .start_time = start_time,
+            .end_time = start_time + duration
+        }
+    );
+
+
+    action(
+        permission_level{get_self(), name("active")},
+        get_self(),
+        name("lognewdutch"),
+        make_tuple(
+            new_sale.sale_id,
+            seller,
+            new_sale.asset_ids,
+            start_price,
+            end_price,
+            start_time,
+            start_time + duration,
+            maker_marketplace,
+            new_sale.collection_name,
+            new_sale.collection_fee
+        )
+    ).send();
+}
+
+
+/**
+* Creates multiple sale listings at once
+* Each listing is handled like an individual announcesale, but the sale ids are taken from the sale counter
+* in one go and a single lognewsales action is sent for all of them
+* 
+* @required_auth seller
+*/
+ACTION atomicmarket::announcebulk(
+    name seller,
+    vector <SALE_LISTING> listings,
+    name maker_marketplace
+) {
+    require_auth(seller);
+
+    check(listings.size() != 0, "listings needs to contain at least one listing");
 
     check(is_valid_marketplace(maker_marketplace), "The maker marketplace is not a valid marketplace");
 
-    double collection_fee = get_collection_fee(assets_collection_name);
-    check(collection_fee <= atomicassets::MAX_MARKET_FEE,
-        "The collection fee is too high. This should have been prevented by the atomicassets contract");
+    atomicassets::assets_t seller_assets = atomicassets::get_assets(seller);
 
-    uint64_t sale_id = consume_counter(name("sale"));
+    uint64_t first_sale_id = consume_counter(name("sale"), listings.size());
 
-    sales.emplace(seller, [&](auto &_sale) {
-        _sale.sale_id = sale_id;
-        _sale.seller = seller;
-        _sale.asset_ids = asset_ids;
-        _sale.offer_id = -1;
-        _sale.listing_price = listing_price;
-        _sale.settlement_symbol = settlement_symbol;
-        _sale.maker_marketplace = maker_marketplace;
-        _sale.collection_name = assets_collection_name;
-        _sale.collection_fee = collection_fee;
-    });
+    vector <NEW_SALE> new_sales = {};
+    for (uint64_t i = 0; i < listings.size(); i++) {
+        new_sales.push_back(internal_create_sale(
+            seller,
+            seller_assets,
+            get_collection_and_check_assets(seller_assets, listings[i].asset_ids),
+            listings[i].asset_ids,
+            listings[i].listing_price,
+            listings[i].settlement_symbol,
+            maker_marketplace,
+            first_sale_id + i,
+            -1,
+            std::nullopt
+        ));
+    }
 
 
     action(
         permission_level{get_self(), name("active")},
         get_self(),
-        name("lognewsale"),
+        name("lognewsales"),
         make_tuple(
-            sale_id,
             seller,
-            asset_ids,
-            listing_price,
-            settlement_symbol,
             maker_marketplace,
-            assets_collection_name,
-            collection_fee
+            new_sales
         )
     ).send();
 }
@@ -470,45 +938,129 @@ ACTION atomicmarket::announcesale(
 ACTION atomicmarket::cancelsale(
     uint64_t sale_id
 ) {
+    sales_t &sales = locate_sales(sale_id);
     auto sale_itr = sales.require_find(sale_id,
         "No sale with this sale_id exists");
 
+    check(is_sale_invalid(*sale_itr) || has_auth(sale_itr->seller),
+        "The sale is not invalid, therefore the authorization of the seller is needed to cancel it");
 
-    bool is_sale_invalid = false;
+    internal_remove_sale(sales, sale_itr);
+}
 
-    if (sale_itr->offer_id != -1) {
-        if (atomicassets::offers.find(sale_itr->offer_id) == atomicassets::offers.end()) {
-            is_sale_invalid = true;
-        }
-    }
 
-    atomicassets::assets_t seller_assets = atomicassets::get_assets(sale_itr->seller);
-    for (uint64_t asset_id : sale_itr->asset_ids) {
-        if (seller_assets.find(asset_id) == seller_assets.end()) {
-            is_sale_invalid = true;
-            break;
-        }
-    }
+/**
+* Changes the price of an existing sale without cancelling it
+* The sale keeps its id and, if it has already been created, its atomicassets offer
+* 
+* The price can be raised and the settlement symbol can be changed while a purchase is pending, so buyers
+* that want to be sure about what they pay need to assert the sale in the same transaction with assertsale
+* or assertsales, or buy it with purchasemax
+* 
+* @required_auth The sale's seller
+*/
+ACTION atomicmarket::setsaleprice(
+    uint64_t sale_id,
+    asset new_listing_price,
+    symbol new_settlement_symbol
+) {
+    name sale_scope = get_listing_scope(name("sale"), sale_id);
+    sales_t &sales = get_sales(sale_scope);
+    auto sale_itr = sales.require_find(sale_id,
+        "No sale with this sale_id exists");
 
-    check(is_sale_invalid || has_auth(sale_itr->seller),
-        "The sale is not invalid, therefore the authorization of the seller is needed to cancel it");
+    require_auth(sale_itr->seller);
 
+    check(!sale_itr->is_dutch(), "The price of a dutch sale can't be changed");
 
-    if (sale_itr->offer_id != -1) {
-        if (atomicassets::offers.find(sale_itr->offer_id) != atomicassets::offers.end()) {
-            //Cancels the atomicassets offer for this sale for convenience
-            action(
-                permission_level{get_self(), name("active")},
-                atomicassets::ATOMICASSETS_ACCOUNT,
-                name("declineoffer"),
-                make_tuple(
-                    sale_itr->offer_id
-                )
-            ).send();
+    check_sale_price(new_listing_price, new_settlement_symbol);
+
+    if (sale_scope == get_self()) {
+        // Sales from before the sales were scoped by collection might not be part of the price indices,
+        // in which case changing their price would fail. They are moved to their collection scope instead
+        sales_s moved_sale = *sale_itr;
+        moved_sale.listing_price = new_listing_price;
+        moved_sale.settlement_symbol = new_settlement_symbol;
+        moved_sale.asset_ids_hash = get_stored_asset_ids_hash(moved_sale.asset_ids);
+        fill_extensions(moved_sale);
+
+        sales.erase(sale_itr);
+        get_sales(moved_sale.collection_name).emplace(moved_sale.seller, [&](auto &_sale) {
+            _sale = moved_sale;
+        });
+        add_locator(name("sale"), sale_id, moved_sale.collection_name, moved_sale.seller);
+
+        add_to_floors(moved_sale);
+
+    } else {
+        sales_s previous_sale = *sale_itr;
+
+        sales.modify(sale_itr, same_payer, [&](auto &_sale) {
+            _sale.listing_price = new_listing_price;
+            _sale.settlement_symbol = new_settlement_symbol;
+        });
+
+        remove_from_floors(previous_sale);
+        add_to_floors(*sale_itr);
+    }
+
+    action(
+        permission_level{get_self(), name("active")},
+        get_self(),
+        name("logsaleprice"),
+        make_tuple(
+            sale_id,
+            new_listing_price,
+            new_settlement_symbol
+        )
+    ).send();
+}
+
+
+/**
+* Removes up to max_rows invalid sales (see cancelsale) of a collection, checking the sales in the order
+* of their ids, starting at the sale with the id cursor
+* 
+* Sales that were created before the sales were scoped by collection can be swept by using the name of
+* the contract as the collection_name
+* 
+* The id to continue with in the next call is logged with the logsalesweep action. It is 0 if the end
+* of the sales of the collection was reached, so that the next sweep starts from the beginning again
+* 
+* @required_auth None, this action can be called by anyone
+*/
+ACTION atomicmarket::sweepsales(
+    name collection_name,
+    uint64_t max_rows,
+    uint64_t cursor
+) {
+    check(max_rows > 0, "max_rows needs to be greater than 0");
+
+    sales_t &sales = get_sales(collection_name);
+
+    uint64_t row_count = 0;
+    uint64_t swept_sales = 0;
+
+    auto sale_itr = sales.lower_bound(cursor);
+    while (sale_itr != sales.end() && row_count < max_rows) {
+        if (is_sale_invalid(*sale_itr)) {
+            sale_itr = internal_remove_sale(sales, sale_itr);
+            swept_sales++;
+        } else {
+            sale_itr++;
         }
+        row_count++;
     }
 
-    sales.erase(sale_itr);
+    action(
+        permission_level{get_self(), name("active")},
+        get_self(),
+        name("logsalesweep"),
+        make_tuple(
+            swept_sales,
+            sale_itr != sales.end() ? sale_itr->sale_id : 0
+        )
+    ).send();
 }
 
 
@@ -528,100 +1080,228 @@ ACTION atomicmarket::purchasesale(
 ) {
     require_auth(buyer);
 
+    sales_t &sales = locate_sales(sale_id);
     auto sale_itr = sales.require_find(sale_id,
         "No sale with this sale_id exists");
 
-    check(buyer != sale_itr->seller, "You can't purchase your own sale");
 
-    check(sale_itr->offer_id != -1,
-        "This sale is not active yet. The seller first has to create an atomicasset offer for this asset");
+    asset sale_price;
 
-    check(atomicassets::offers.find(sale_itr->offer_id) != atomicassets::offers.end(),
-        "The seller cancelled the atomicassets offer related to this sale");
+    if (sale_itr->listing_price.symbol == sale_itr->settlement_symbol) {
+        check(intended_delphi_median == 0, "intended delphi median needs to be 0 for non delphi sales");
+        sale_price = sale_itr->get_price_at(current_time_point().sec_since_epoch());
 
-    check(is_valid_marketplace(taker_marketplace), "The taker marketplace is not a valid marketplace");
+    } else {
+        SYMBOLPAIR symbol_pair = require_get_symbol_pair(sale_itr->listing_price.symbol, sale_itr->settlement_symbol);
+
+        delphicache_s delphi_cache = get_delphi_cache(symbol_pair.delphi_pair_name);
+
+        // The delphioracle only needs to be searched if the buyer did not use the cached median
+        if (intended_delphi_median != delphi_cache.median) {
+            check(is_recent_delphi_median(symbol_pair.delphi_pair_name, intended_delphi_median),
+                "No datapoint with the intended median was found. You likely took too long to confirm your transaction");
+        }
+
+        sale_price = get_delphi_settlement_price(
+            sale_itr->listing_price,
+            symbol_pair,
+            intended_delphi_median,
+            delphi_cache.quoted_precision
+        );
+
+    }
+
+    internal_purchase_sale(buyer, sales, sale_itr, sale_price, taker_marketplace);
+}
+
+
+/**
+* Purchases an asset that is for sale, paying at most max_settlement_price
+* 
+* For sales using a delphi pairing, the price is calculated using the median of the latest datapoint of the
+* delphi pair instead of a median chosen by the buyer. The cached median is not used, because it can be
+* up to a delphi cache window old. The purchase only fails if that price is higher than max_settlement_price.
+* 
+* @required_auth buyer
+*/
+ACTION atomicmarket::purchasemax(
+    name buyer,
+    uint64_t sale_id,
+    asset max_settlement_price,
+    name taker_marketplace
+) {
+    require_auth(buyer);
+
+    check(max_settlement_price.is_valid(), "Invalid type max_settlement_price");
+
+    sales_t &sales = locate_sales(sale_id);
+    auto sale_itr = sales.require_find(sale_id,
+        "No sale with this sale_id exists");
+
+    check(max_settlement_price.symbol == sale_itr->settlement_symbol,
+        "The max settlement price uses a different symbol than the settlement symbol of the sale");
 
 
     asset sale_price;
 
     if (sale_itr->listing_price.symbol == sale_itr->settlement_symbol) {
-        check(intended_delphi_median == 0, "intended delphi median needs to be 0 for non delphi sales");
-        sale_price = sale_itr->listing_price;
+        sale_price = sale_itr->get_price_at(current_time_point().sec_since_epoch());
 
     } else {
         SYMBOLPAIR symbol_pair = require_get_symbol_pair(sale_itr->listing_price.symbol, sale_itr->settlement_symbol);
 
-        delphioracle::datapoints_t datapoints = delphioracle::get_datapoints(symbol_pair.delphi_pair_name);
+        delphicache_s delphi_cache = get_delphi_cache(symbol_pair.delphi_pair_name, true);
 
-        bool found_point_with_median = false;
-        for (auto itr = datapoints.begin(); itr != datapoints.end(); itr++) {
-            if (itr->median == intended_delphi_median) {
-                found_point_with_median = true;
-                break;
-            }
-        }
-        check(found_point_with_median,
-            "No datapoint with the intended median was found. You likely took too long to confirm your transaction");
+        sale_price = get_delphi_settlement_price(
+            sale_itr->listing_price,
+            symbol_pair,
+            delphi_cache.median,
+            delphi_cache.quoted_precision
+        );
+    }
 
+    check(sale_price.amount <= max_settlement_price.amount,
+        ("The settlement price of the sale is higher than the max settlement price - "
+        + sale_price.to_string()).c_str());
 
-        //Using the price denoted in the listing symbol and the median price provided by the delphioracle,
-        //the final price in the settlement token is calculated
-        auto pair_itr = delphioracle::pairs.find(symbol_pair.delphi_pair_name.value);
+    internal_purchase_sale(buyer, sales, sale_itr, sale_price, taker_marketplace);
+}
 
-        uint64_t settlement_price_amount;
 
-        if (!symbol_pair.invert_delphi_pair) {
-            //Normal
-            settlement_price_amount = (double) sale_itr->listing_price.amount / (double) intended_delphi_median * pow(
-                10, pair_itr->quoted_precision + sale_itr->settlement_symbol.precision() -
-                    sale_itr->listing_price.symbol.precision()
-            );
-        } else {
-            //Inverted
-            settlement_price_amount = (double) sale_itr->listing_price.amount * (double) intended_delphi_median * pow(
-                10, -pair_itr->quoted_precision + sale_itr->settlement_symbol.precision() -
-                    sale_itr->listing_price.symbol.precision()
-            );
-        }
+/**
+* Purchases multiple sales at once
+* 
+* Compared to individual purchasesale actions, the total price is deducted from the buyer's balance
+* at once, the fees are added to the balance of each fee recipient at once, each seller receives one
+* token transfer (per token) for all of their sales, and all purchased assets are transferred to the
+* buyer in a single atomicassets transfer
+* 
+* Sales using a delphi pairing can't be purchased with this action
+* 
+* @required_auth buyer
+*/
+ACTION atomicmarket::purchasecart(
+    name buyer,
+    vector <uint64_t> sale_ids,
+    name taker_marketplace
+) {
+    require_auth(buyer);
 
-        sale_price = asset(settlement_price_amount, sale_itr->settlement_symbol);
+    check(sale_ids.size() != 0, "sale_ids needs to contain at least one id");
 
-    }
+    vector <uint64_t> sale_ids_copy = sale_ids;
+    std::sort(sale_ids_copy.begin(), sale_ids_copy.end());
+    check(std::adjacent_find(sale_ids_copy.begin(), sale_ids_copy.end()) == sale_ids_copy.end(),
+        "The sale_ids must not contain duplicates");
+
+    check(is_valid_marketplace(taker_marketplace), "The taker marketplace is not a valid marketplace");
 
 
-    internal_decrease_balance(
+    CART cart = {};
+
+    for (uint64_t sale_id : sale_ids) {
+        sales_t &sales = locate_sales(sale_id);
+        auto sale_itr = sales.require_find(sale_id,
+            ("No sale with this sale_id exists - " + to_string(sale_id)).c_str());
+
+        add_to_cart(cart, buyer, sales, sale_itr, taker_marketplace);
+    }
+
+    settle_cart(
+        cart,
         buyer,
-        sale_price
+        "AtomicMarket Sale Payout - Cart purchase by " + buyer.to_string(),
+        "AtomicMarket Purchased Sales - Cart"
     );
+}
 
-    internal_payout_sale(
-        sale_price,
-        sale_itr->seller,
-        sale_itr->maker_marketplace,
-        taker_marketplace,
-        get_collection_author(sale_itr->collection_name),
-        sale_itr->collection_fee,
-        name("sale"),
-        sale_id,
-        "AtomicMarket Sale Payout - ID #" + to_string(sale_id)
-    );
 
-    action(
-        permission_level{get_self(), name("active")},
-        atomicassets::ATOMICASSETS_ACCOUNT,
-        name("acceptoffer"),
-        make_tuple(
-            sale_itr->offer_id
-        )
-    ).send();
+/**
+* Purchases up to max_count of the cheapest sales of a collection that are settled in the symbol of max_total,
+* paying at most max_total in total
+* 
+* If template_id is -1, all sales of the collection are considered, otherwise only sales of a single asset
+* of that template
+* 
+* The purchased sales are paid out like in purchasecart. Sales using a delphi pairing, dutch sales, sales that
+* are not active, invalid sales (see cancelsale) and sales of the buyer are skipped
+* At most max_rows sales are looked at, including the skipped ones
+* 
+* @required_auth buyer
+*/
+ACTION atomicmarket::sweepfloor(
+    name buyer,
+    name collection_name,
+    int32_t template_id,
+    uint64_t max_count,
+    asset max_total,
+    uint64_t max_rows,
+    name taker_marketplace
+) {
+    require_auth(buyer);
 
-    internal_transfer_assets(
+    check(max_total.is_valid(), "Invalid type max_total");
+    check(max_count > 0, "max_count needs to be greater than 0");
+    check(max_rows > 0, "max_rows needs to be greater than 0");
+
+    check(is_valid_marketplace(taker_marketplace), "The taker marketplace is not a valid marketplace");
+
+
+    sales_t &sales = get_sales(collection_name);
+
+    CART cart = {};
+    uint64_t purchased_count = 0;
+    uint64_t row_count = 0;
+    int64_t remaining_amount = max_total.amount;
+
+    // Walks the index from first_key (the cheapest sale) until end_key (the first sale using a delphi pair)
+    auto sweep_index = [&](auto sales_index, auto first_key, auto end_key, auto get_key) {
+        auto index_itr = sales_index.lower_bound(first_key);
+        while (index_itr != sales_index.end() && get_key(*index_itr) < end_key
+            && purchased_count < max_count && row_count < max_rows) {
+            auto sale_itr = sales.iterator_to(*index_itr);
+            index_itr++;
+            row_count++;
+
+            if (sale_itr->seller == buyer || sale_itr->offer_id == -1 || is_sale_invalid(*sale_itr)) {
+                continue;
+            }
+
+            // The sales are ordered by price, so none of the following sales fit into the budget either
+            if (sale_itr->listing_price.amount > remaining_amount) {
+                break;
+            }
+
+            remaining_amount -= sale_itr->listing_price.amount;
+            purchased_count++;
+            add_to_cart(cart, buyer, sales, sale_itr, taker_marketplace);
+        }
+    };
+
+    if (template_id == -1) {
+        sweep_index(
+            sales.get_index <name("price")>(),
+            sale_price_key(max_total.symbol, 0),
+            sale_price_key(max_total.symbol, UINT64_MAX),
+            [](const sales_s &sale) { return sale.by_price(); }
+        );
+    } else {
+        sweep_index(
+            sales.get_index <name("templprice")>(),
+            sale_template_price_key(template_id, max_total.symbol, 0),
+            sale_template_price_key(template_id, max_total.symbol, UINT64_MAX),
+            [](const sales_s &sale) { return sale.by_template_price(); }
+        );
+    }
+
+    check(purchased_count > 0, "No active sale within the budget was found");
+
+    settle_cart(
+        cart,
         buyer,
-        sale_itr->asset_ids,
-        "AtomicMarket Purchased Sale - ID # " + to_string(sale_id)
+        "AtomicMarket Sale Payout - Floor sweep by " + buyer.to_string(),
+        "AtomicMarket Purchased Sales - Floor sweep"
     );
-
-    sales.erase(sale_itr);
 }
 
 
@@ -640,20 +1320,26 @@ ACTION atomicmarket::assertsale(
     asset listing_price_to_assert,
     symbol settlement_symbol_to_assert
 ) {
-    check(listing_price_to_assert.is_valid(), "Invalid type listing_price_to_assert");
-    check(settlement_symbol_to_assert.is_valid(), "Invalid type settlement_symbol_to_assert");
+    internal_assert_sale(sale_id, asset_ids_to_assert, listing_price_to_assert, settlement_symbol_to_assert);
+}
 
-    auto sale_itr = sales.require_find(sale_id,
-        "No sale with this sale_id exists");
-    
-    check(std::is_permutation(asset_ids_to_assert.begin(), asset_ids_to_assert.end(), sale_itr->asset_ids.begin()),
-        "The asset ids to assert differ from the asset ids of this sale");
-    
-    check(listing_price_to_assert == sale_itr->listing_price,
-        "The listing price to assert differs from the listing price of this sale");
-    
-    check(settlement_symbol_to_assert == sale_itr->settlement_symbol,
-        "The settlement symbol to assert differs from the settlement symbol of this sale");
+
+/**
+* Checks multiple sales like assertsale at once, e.g. before purchasing them with purchasecart
+* 
+* @required_auth None
+*/
+ACTION atomicmarket::assertsales(
+    vector <SALE_ASSERTION> sale_assertions
+) {
+    for (const SALE_ASSERTION &sale_assertion : sale_assertions) {
+        internal_assert_sale(
+            sale_assertion.sale_id,
+            sale_assertion.asset_ids,
+            sale_assertion.listing_price,
+            sale_assertion.settlement_symbol
+        );
+    }
 }
 
 
@@ -675,78 +1361,15 @@ ACTION atomicmarket::announceauct(
 ) {
     require_auth(seller);
 
-    check(starting_bid.is_valid(), "Invalid type starting_bid");
-
-    name assets_collection_name = get_collection_and_check_assets(seller, asset_ids);
-
-
-    checksum256 asset_ids_hash = hash_asset_ids(asset_ids);
-
-    auto auctions_by_hash = auctions.get_index <name("assetidshash")>();
-    auto auction_itr = auctions_by_hash.find(asset_ids_hash);
-
-    while (auction_itr != auctions_by_hash.end()) {
-        if (asset_ids_hash != auction_itr->asset_ids_hash()) {
-            break;
-        }
-
-        check(auction_itr->seller != seller,
-            "You have already announced an auction for these assets. You can cancel an auction using the cancelauct action.");
-
-        auction_itr++;
-    }
-
-
-    check(is_symbol_supported(starting_bid.symbol), "The specified starting bid token is not supported.");
-    check(starting_bid.amount > 0, "The starting bid must be greater than zero");
-
-    check(is_valid_marketplace(maker_marketplace), "The maker marketplace is not a valid marketplace");
-
-    double collection_fee = get_collection_fee(assets_collection_name);
-    check(collection_fee <= atomicassets::MAX_MARKET_FEE,
-        "The collection fee is too high. This should have been prevented by the atomicassets contract");
-
-    config_s current_config = config.get();
-    check(duration >= current_config.minimum_auction_duration,
-        "The specified duration is shorter than the minimum auction duration");
-    check(duration <= current_config.maximum_auction_duration,
-        "The specified duration is longer than the maximum auction duration");
-
-    uint64_t auction_id = consume_counter(name("auction"));
-
-    auctions.emplace(seller, [&](auto &_auction) {
-        _auction.auction_id = auction_id;
-        _auction.seller = seller;
-        _auction.asset_ids = asset_ids;
-        _auction.end_time = current_time_point().sec_since_epoch() + duration;
-        _auction.assets_transferred = false;
-        _auction.current_bid = starting_bid;
-        _auction.current_bidder = name("");
-        _auction.claimed_by_seller = false;
-        _auction.claimed_by_buyer = false;
-        _auction.maker_marketplace = maker_marketplace;
-        _auction.taker_marketplace = name("");
-        _auction.collection_name = assets_collection_name;
-        _auction.collection_fee = collection_fee;
-    });
-
-
-    action(
-        permission_level{get_self(), name("active")},
-        get_self(),
-        name("lognewauct"),
-        make_tuple(
-            auction_id,
-            seller,
-            asset_ids,
-            starting_bid,
-            duration,
-            current_time_point().sec_since_epoch() + duration,
-            maker_marketplace,
-            assets_collection_name,
-            collection_fee
-        )
-    ).send();
+    internal_create_auction(
+        seller,
+        get_collection_and_check_assets(seller, asset_ids),
+        asset_ids,
+        starting_bid,
+        duration,
+        maker_marketplace,
+        false
+    );
 }
 
 
@@ -762,6 +1385,7 @@ ACTION atomicmarket::announceauct(
 ACTION atomicmarket::cancelauct(
     uint64_t auction_id
 ) {
+    auctions_t &auctions = locate_auctions(auction_id);
     auto auction_itr = auctions.require_find(auction_id,
         "No auction with this auction_id exists");
 
@@ -794,6 +1418,7 @@ ACTION atomicmarket::cancelauct(
     }
 
     auctions.erase(auction_itr);
+    remove_locator(name("auction"), auction_id);
 }
 
 
@@ -802,6 +1427,9 @@ ACTION atomicmarket::cancelauct(
 * The bid is deducted from the buyer's balance
 * If a higher bid gets placed by someone else, the original bid will be refunded to the original buyer's balance
 * 
+* If the current highest bidder has placed a proxy bid with a maximum bid that is at least as high as this bid,
+* their proxy bid answers this bid right away and they stay the highest bidder
+* 
 * @required_auth bidder
 */
 ACTION atomicmarket::auctionbid(
@@ -814,54 +1442,51 @@ ACTION atomicmarket::auctionbid(
 
     check(bid.is_valid(), "Invalid type bid");
 
+    auctions_t &auctions = locate_auctions(auction_id);
     auto auction_itr = auctions.require_find(auction_id,
         "No auction with this auction_id exists");
 
-    check(bidder != auction_itr->seller, "You can't bid on your own auction");
+    internal_place_bid(bidder, auctions, auction_itr, bid, bid, taker_marketplace);
+}
 
-    check(auction_itr->assets_transferred,
-        "The auction is not yet active. The seller first needs to transfer the asset to the atomicmarket account");
 
-    check(current_time_point().sec_since_epoch() < auction_itr->end_time,
-        "The auction is already finished");
+/**
+* Places a proxy bid on an auction
+* The maximum bid is deducted from the buyer's balance, but the bid itself is only the minimum bid that is
+* needed to become the highest bidder
+* When someone else bids afterwards, the bid is automatically raised by the minimum bid increase up to the
+* maximum bid, so that a bidding war is resolved within the action of the competing bid
+* 
+* Whatever part of the maximum bid is not needed is refunded to the buyer's balance once the auction is paid out
+* 
+* @required_auth bidder
+*/
+ACTION atomicmarket::auctproxybid(
+    name bidder,
+    uint64_t auction_id,
+    asset max_bid,
+    name taker_marketplace
+) {
+    require_auth(bidder);
 
-    check(bid.symbol == auction_itr->current_bid.symbol,
-        "The bid uses a different symbol than the current auction bid");
+    check(max_bid.is_valid(), "Invalid type max_bid");
 
-    config_s current_config = config.get();
-    if (auction_itr->current_bidder == name("")) {
-        check(bid.amount >= auction_itr->current_bid.amount,
-            "The bid must be at least as high as the minimum bid");
-    } else {
-        check((double) bid.amount >=
-              (double) auction_itr->current_bid.amount * (1.0 + current_config.minimum_bid_increase),
-            "The relative increase is less than the minimum bid increase specified in the config");
-    }
+    auctions_t &auctions = locate_auctions(auction_id);
+    auto auction_itr = auctions.require_find(auction_id,
+        "No auction with this auction_id exists");
 
+    check(max_bid.symbol == auction_itr->current_bid.symbol,
+        "The bid uses a different symbol than the current auction bid");
 
-    if (auction_itr->current_bidder != name("")) {
-        internal_add_balance(
-            auction_itr->current_bidder,
-            auction_itr->current_bid
+    asset bid = auction_itr->current_bid;
+    if (auction_itr->current_bidder != name("") && auction_itr->current_bidder != bidder) {
+        bid.amount = (int64_t) get_next_bid_amount(
+            auction_itr->current_bid.amount,
+            get_config().minimum_bid_increase_ppm.value()
         );
     }
 
-    internal_decrease_balance(
-        bidder,
-        bid
-    );
-
-    check(is_valid_marketplace(taker_marketplace), "The taker marketplace is not a valid marketplace");
-
-    auctions.modify(auction_itr, same_payer, [&](auto &_auction) {
-        _auction.current_bid = bid;
-        _auction.current_bidder = bidder;
-        _auction.taker_marketplace = taker_marketplace;
-        _auction.end_time = std::max(
-            _auction.end_time,
-            current_time_point().sec_since_epoch() + current_config.auction_reset_duration
-        );
-    });
+    internal_place_bid(bidder, auctions, auction_itr, bid, max_bid, taker_marketplace);
 }
 
 
@@ -873,6 +1498,7 @@ ACTION atomicmarket::auctionbid(
 ACTION atomicmarket::auctclaimbuy(
     uint64_t auction_id
 ) {
+    auctions_t &auctions = locate_auctions(auction_id);
     auto auction_itr = auctions.require_find(auction_id,
         "No auction with this auction_id exists");
 
@@ -897,7 +1523,11 @@ ACTION atomicmarket::auctclaimbuy(
 
     if (auction_itr->claimed_by_seller) {
         auctions.erase(auction_itr);
+        remove_locator(name("auction"), auction_id);
     } else {
+        check(!is_unconverted_listing(*auction_itr),
+            "This auction needs to be converted with the convhashes action before it can be claimed by one side");
+
         auctions.modify(auction_itr, same_payer, [&](auto &_auction) {
             _auction.claimed_by_buyer = true;
         });
@@ -915,6 +1545,7 @@ ACTION atomicmarket::auctclaimbuy(
 ACTION atomicmarket::auctclaimsel(
     uint64_t auction_id
 ) {
+    auctions_t &auctions = locate_auctions(auction_id);
     auto auction_itr = auctions.require_find(auction_id,
         "No auction with this auction_id exists");
 
@@ -931,21 +1562,15 @@ ACTION atomicmarket::auctclaimsel(
     check(!auction_itr->claimed_by_seller,
         "The auction has already been claimed by the seller");
 
-    internal_payout_sale(
-        auction_itr->current_bid,
-        auction_itr->seller,
-        auction_itr->maker_marketplace,
-        auction_itr->taker_marketplace,
-        get_collection_author(auction_itr->collection_name),
-        auction_itr->collection_fee,
-        name("auction"),
-        auction_id,
-        "AtomicMarket Auction Payout - ID #" + to_string(auction_id)
-    );
+    internal_payout_auction(*auction_itr);
 
     if (auction_itr->claimed_by_buyer) {
         auctions.erase(auction_itr);
+        remove_locator(name("auction"), auction_id);
     } else {
+        check(!is_unconverted_listing(*auction_itr),
+            "This auction needs to be converted with the convhashes action before it can be claimed by one side");
+
         auctions.modify(auction_itr, same_payer, [&](auto &_auction) {
             _auction.claimed_by_seller = true;
         });
@@ -953,6 +1578,35 @@ ACTION atomicmarket::auctclaimsel(
 }
 
 
+/**
+* Claims both sides of a finished auction at once
+* The highest bid is paid out like in auctclaimsel and the assets are transferred to the highest bidder
+* like in auctclaimbuy, without writing the claimed flags in between
+* 
+* @required_auth The auction's seller or the highest bidder of the auction
+*/
+ACTION atomicmarket::auctsettle(
+    uint64_t auction_id
+) {
+    auctions_t &auctions = locate_auctions(auction_id);
+    auto auction_itr = auctions.require_find(auction_id,
+        "No auction with this auction_id exists");
+
+    check(auction_itr->assets_transferred, "The auction is not active");
+
+    check(auction_itr->current_bidder != name(""),
+        "The auction does not have any bids");
+
+    check(has_auth(auction_itr->seller) || has_auth(auction_itr->current_bidder),
+        "The auction can only be settled by its seller or its highest bidder");
+
+    check(auction_itr->end_time < current_time_point().sec_since_epoch(),
+        "The auction is not finished yet");
+
+    internal_settle_auction(auctions, auction_itr);
+}
+
+
 /**
 * Checks whether the provided asset ids match those of the auction with the specified id
 * and throws the transaction if this is not the case
@@ -966,11 +1620,89 @@ ACTION atomicmarket::assertauct(
     uint64_t auction_id,
     vector <uint64_t> asset_ids_to_assert
 ) {
-    auto auction_itr = auctions.require_find(auction_id,
-        "No auction with this auction_id exists");
-    
-    check(std::is_permutation(asset_ids_to_assert.begin(), asset_ids_to_assert.end(), auction_itr->asset_ids.begin()),
-        "The asset ids to assert differ from the asset ids of this auction");
+    internal_assert_auction(auction_id, asset_ids_to_assert);
+}
+
+
+/**
+* Checks multiple auctions like assertauct at once
+* 
+* @required_auth None
+*/
+ACTION atomicmarket::assertaucts(
+    vector <AUCTION_ASSERTION> auction_assertions
+) {
+    for (const AUCTION_ASSERTION &auction_assertion : auction_assertions) {
+        internal_assert_auction(auction_assertion.auction_id, auction_assertion.asset_ids);
+    }
+}
+
+
+/**
+* Settles up to max_rows finished auctions of a collection, starting with the auctions that ended first
+* 
+* If start_after_id is not 0, the settling starts after the auction with that id instead, in the order of the
+* end times. This allows skipping an auction whose settlement fails, for example because the seller or the
+* highest bidder rejects the asset transfer, which would otherwise block all later auctions
+* 
+* For auctions with bids, the parts that have not been claimed yet are done like in auctclaimsel and auctclaimbuy:
+* the highest bid is paid out and the assets are transferred to the highest bidder
+* The assets of auctions without bids are transferred back to their sellers
+* The settled auctions are erased
+* 
+* Auctions that were created before the auctions were scoped by collection need to be moved with convscopes
+* before they can be settled
+* 
+* @required_auth None, this action can be called by anyone
+*/
+ACTION atomicmarket::settleaucts(
+    name collection_name,
+    uint64_t max_rows,
+    uint64_t start_after_id
+) {
+    check(max_rows > 0, "max_rows needs to be greater than 0");
+
+    auctions_t &auctions = get_auctions(collection_name);
+    auto auctions_by_end_time = auctions.get_index <name("endtime")>();
+
+    uint32_t current_time = current_time_point().sec_since_epoch();
+
+    uint64_t row_count = 0;
+    // Rows that are not part of the end time index use 0, so the walk starts at 1
+    auto end_time_itr = auctions_by_end_time.lower_bound(1);
+    if (start_after_id != 0) {
+        const auctions_s &start_after_auction = auctions.get(start_after_id,
+            "No auction with the id start_after_id exists in this collection");
+        check(start_after_auction.by_end_time() != 0,
+            "The auction with the id start_after_id is not part of the end time index yet");
+        end_time_itr = ++auctions_by_end_time.iterator_to(start_after_auction);
+    }
+    while (end_time_itr != auctions_by_end_time.end()
+        && end_time_itr->end_time < current_time
+        && row_count < max_rows
+    ) {
+        auto auction_itr = auctions.iterator_to(*end_time_itr);
+        end_time_itr++;
+        row_count++;
+
+        if (auction_itr->assets_transferred && auction_itr->current_bidder != name("")) {
+            internal_settle_auction(auctions, auction_itr);
+            continue;
+        }
+
+        uint64_t auction_id = auction_itr->auction_id;
+
+        if (auction_itr->assets_transferred) {
+            internal_transfer_assets(
+                auction_itr->seller,
+                auction_itr->asset_ids,
+                "AtomicMarket Unsold Auction - ID # " + to_string(auction_id)
+            );
+        }
+
+        auctions.erase(auction_itr);
+        remove_locator(name("auction"), auction_id);
+    }
 }
 
 
@@ -1009,9 +1741,11 @@ ACTION atomicmarket::createbuyo(
 
     check(is_valid_marketplace(maker_marketplace), "The maker marketplace is not a valid marketplace");
 
+    double collection_fee = get_collection_fee(assets_collection_name);
+
     uint64_t buyoffer_id = consume_counter(name("buyoffer"));
 
-    buyoffers.emplace(buyer, [&](auto &_buyoffer) {
+    get_buyoffers(assets_collection_name).emplace(buyer, [&](auto &_buyoffer) {
         _buyoffer.buyoffer_id = buyoffer_id;
         _buyoffer.buyer = buyer;
         _buyoffer.recipient = recipient;
@@ -1020,8 +1754,10 @@ ACTION atomicmarket::createbuyo(
         _buyoffer.memo = memo;
         _buyoffer.maker_marketplace = maker_marketplace;
         _buyoffer.collection_name = assets_collection_name;
-        _buyoffer.collection_fee = get_collection_fee(assets_collection_name);
+        _buyoffer.collection_fee = collection_fee;
+        _buyoffer.collection_fee_ppm = fee_to_ppm(collection_fee);
     });
+    add_locator(name("buyoffer"), buyoffer_id, assets_collection_name, buyer);
 
 
     action(
@@ -1037,7 +1773,7 @@ ACTION atomicmarket::createbuyo(
             memo,
             maker_marketplace,
             assets_collection_name,
-            get_collection_fee(assets_collection_name)
+            collection_fee
         )
     ).send();
 }
@@ -1053,6 +1789,7 @@ ACTION atomicmarket::createbuyo(
 ACTION atomicmarket::cancelbuyo(
     uint64_t buyoffer_id
 ) {
+    buyoffers_t &buyoffers = locate_buyoffers(buyoffer_id);
     auto buyoffer_itr = buyoffers.require_find(buyoffer_id,
         "No buyoffer with this id exists");
     
@@ -1061,6 +1798,7 @@ ACTION atomicmarket::cancelbuyo(
     internal_add_balance(buyoffer_itr->buyer, buyoffer_itr->price);
 
     buyoffers.erase(buyoffer_itr);
+    remove_locator(name("buyoffer"), buyoffer_id);
 }
 
 
@@ -1089,6 +1827,7 @@ ACTION atomicmarket::acceptbuyo(
 ) {
     check(expected_price.is_valid(), "Invalid type expected_price");
 
+    buyoffers_t &buyoffers = locate_buyoffers(buyoffer_id);
     auto buyoffer_itr = buyoffers.require_find(buyoffer_id,
         "No buyoffer with this id exists");
     
@@ -1149,7 +1888,7 @@ ACTION atomicmarket::acceptbuyo(
         buyoffer_itr->maker_marketplace,
         taker_marketplace,
         get_collection_author(buyoffer_itr->collection_name),
-        buyoffer_itr->collection_fee,
+        get_collection_fee_ppm(*buyoffer_itr),
         name("buyoffer"),
         buyoffer_id,
         "AtomicMarket Buyoffer Payout - ID #" + to_string(buyoffer_id)
@@ -1157,6 +1896,7 @@ ACTION atomicmarket::acceptbuyo(
 
 
     buyoffers.erase(buyoffer_itr);
+    remove_locator(name("buyoffer"), buyoffer_id);
 }
 
 
@@ -1169,6 +1909,7 @@ ACTION atomicmarket::declinebuyo(
     uint64_t buyoffer_id,
     string decline_memo
 ) {
+    buyoffers_t &buyoffers = locate_buyoffers(buyoffer_id);
     auto buyoffer_itr = buyoffers.require_find(buyoffer_id,
         "No buyoffer with this id exists");
     
@@ -1179,6 +1920,148 @@ ACTION atomicmarket::declinebuyo(
     internal_add_balance(buyoffer_itr->buyer, buyoffer_itr->price);
 
     buyoffers.erase(buyoffer_itr);
+    remove_locator(name("buyoffer"), buyoffer_id);
+}
+
+
+/**
+* Accepts multiple buyoffers of the same recipient at once
+* 
+* Instead of one AtomicAssets offer per buyoffer, the recipient creates a single AtomicAssets offer to the
+* AtomicMarket contract with the memo "buyoffer" that contains the assets of all buyoffers. It needs to be the
+* last created AtomicAssets offer, like in acceptbuyo
+* 
+* The assets are transferred to each buyer at once and the prices are paid out like a cart: the fees are added
+* to the balance of each fee recipient at once and the recipient receives one token transfer per token
+* 
+* @required_auth The recipient of the buyoffers
+*/
+ACTION atomicmarket::acceptbuyos(
+    vector <BUYOFFER_ACCEPTANCE> buyoffer_acceptances,
+    name taker_marketplace
+) {
+    check(buyoffer_acceptances.size() != 0, "buyoffer_acceptances needs to contain at least one buyoffer");
+
+    check(is_valid_marketplace(taker_marketplace), "The taker marketplace is not a valid marketplace");
+
+    uint64_t first_buyoffer_id = buyoffer_acceptances[0].buyoffer_id;
+    name recipient = locate_buyoffers(first_buyoffer_id).require_find(first_buyoffer_id,
+        ("No buyoffer with this id exists - " + to_string(first_buyoffer_id)).c_str())->recipient;
+
+    require_auth(recipient);
+
+    CART cart = {};
+    std::map <name, vector <uint64_t>> buyer_asset_ids;
+
+    for (const BUYOFFER_ACCEPTANCE &acceptance : buyoffer_acceptances) {
+        uint64_t buyoffer_id = acceptance.buyoffer_id;
+
+        check(acceptance.expected_price.is_valid(), "Invalid type expected_price");
+
+        // The buyoffers are erased right away, so duplicate ids fail here
+        buyoffers_t &buyoffers = locate_buyoffers(buyoffer_id);
+        auto buyoffer_itr = buyoffers.require_find(buyoffer_id,
+            ("No buyoffer with this id exists - " + to_string(buyoffer_id)).c_str());
+
+        check(buyoffer_itr->recipient == recipient,
+            ("All buyoffers need to have the same recipient - " + to_string(buyoffer_id)).c_str());
+
+        check(are_same_asset_ids(buyoffer_itr->asset_ids, acceptance.expected_asset_ids),
+            ("The asset ids of this buyoffer differ from the expected asset ids - " + to_string(buyoffer_id)).c_str());
+        check(buyoffer_itr->price == acceptance.expected_price,
+            ("The price of this buyoffer differs from the expected price - " + to_string(buyoffer_id)).c_str());
+
+        add_payout_to_cart(
+            cart,
+            buyoffer_itr->price,
+            recipient,
+            buyoffer_itr->maker_marketplace,
+            taker_marketplace,
+            get_collection_author(buyoffer_itr->collection_name),
+            get_collection_fee_ppm(*buyoffer_itr),
+            name("buyoffer"),
+            buyoffer_id
+        );
+
+        vector <uint64_t> &asset_ids = buyer_asset_ids[buyoffer_itr->buyer];
+        asset_ids.insert(asset_ids.end(), buyoffer_itr->asset_ids.begin(), buyoffer_itr->asset_ids.end());
+        cart.asset_ids.insert(cart.asset_ids.end(), buyoffer_itr->asset_ids.begin(), buyoffer_itr->asset_ids.end());
+
+        buyoffers.erase(buyoffer_itr);
+        remove_locator(name("buyoffer"), buyoffer_id);
+    }
+
+    // This could theoretically fail if there is not a single AtomicAssets offer exists
+    // Because it is assumed that this will rarely if ever be the case, no explicit check is added for that
+    auto last_offer_itr = --atomicassets::offers.end();
+
+    check(last_offer_itr->sender == recipient && last_offer_itr->recipient == get_self(),
+        "The last created AtomicAssets offer must be from the buyoffer recipient to the AtomicMarket contract");
+
+    check(are_same_asset_ids(last_offer_itr->sender_asset_ids, cart.asset_ids),
+        "The last created AtomicAssets offer must contain exactly the assets of the buyoffers");
+    check(last_offer_itr->recipient_asset_ids.size() == 0,
+        "The last created AtomicAssets offer must not ask for any assets in return");
+
+    check(last_offer_itr->memo == "buyoffer",
+        "The last created AtomicAssets offer must have the memo \"buyoffer\"");
+
+
+    // It is not checked whether the AtomicAssets offer is valid, because this will be checked in the
+    // acceptoffer action, and if the offer is invalid, the transaction will throw
+    action(
+        permission_level{get_self(), name("active")},
+        atomicassets::ATOMICASSETS_ACCOUNT,
+        name("acceptoffer"),
+        make_tuple(
+            last_offer_itr->offer_id
+        )
+    ).send();
+
+    for (const auto &[buyer, asset_ids] : buyer_asset_ids) {
+        internal_transfer_assets(
+            buyer,
+            asset_ids,
+            "AtomicMarket Accepted Buyoffers"
+        );
+    }
+
+    pay_out_cart(cart, "AtomicMarket Buyoffer Payout - Accepted Buyoffers");
+}
+
+
+/**
+* Declines multiple buyoffers at once
+* The prices are refunded with one balance write per buyer
+* 
+* @required_auth The recipients of the buyoffers
+*/
+ACTION atomicmarket::declinebuyos(
+    vector <uint64_t> buyoffer_ids,
+    string decline_memo
+) {
+    check(buyoffer_ids.size() != 0, "buyoffer_ids needs to contain at least one buyoffer id");
+
+    check(decline_memo.length() <= 256, "A decline memo can only be 256 characters max");
+
+    std::map <name, vector <asset>> buyer_refunds;
+
+    for (uint64_t buyoffer_id : buyoffer_ids) {
+        buyoffers_t &buyoffers = locate_buyoffers(buyoffer_id);
+        auto buyoffer_itr = buyoffers.require_find(buyoffer_id,
+            ("No buyoffer with this id exists - " + to_string(buyoffer_id)).c_str());
+
+        require_auth(buyoffer_itr->recipient);
+
+        add_to_quantities(buyer_refunds[buyoffer_itr->buyer], buyoffer_itr->price);
+
+        buyoffers.erase(buyoffer_itr);
+        remove_locator(name("buyoffer"), buyoffer_id);
+    }
+
+    for (const auto &[buyer, quantities] : buyer_refunds) {
+        internal_add_balances(buyer, quantities);
+    }
 }
 
 ACTION atomicmarket::createtbuyo(
@@ -1206,7 +2089,7 @@ ACTION atomicmarket::createtbuyo(
     double collection_fee = get_collection_fee(collection_name);
 
     uint64_t buyoffer_id = consume_counter(name("tbuyoffer"));
-    template_buyoffers.emplace(buyer, [&](auto &entry) {
+    get_template_buyoffers(collection_name).emplace(buyer, [&](auto &entry) {
         entry.buyoffer_id = buyoffer_id;
         entry.buyer = buyer;
         entry.price = price;
@@ -1214,7 +2097,9 @@ ACTION atomicmarket::createtbuyo(
         entry.maker_marketplace = maker_marketplace;
         entry.collection_name = collection_name;
         entry.collection_fee = collection_fee;
+        entry.collection_fee_ppm = fee_to_ppm(collection_fee);
     });
+    add_locator(name("tbuyoffer"), buyoffer_id, collection_name, buyer);
 
     action(
         permission_level{get_self(), name("active")},
@@ -1233,6 +2118,7 @@ ACTION atomicmarket::createtbuyo(
 }
 
 ACTION atomicmarket::canceltbuyo(uint64_t buyoffer_id) {
+    template_buyoffers_t &template_buyoffers = locate_template_buyoffers(buyoffer_id);
     auto buyoffer_itr = template_buyoffers.require_find(
         buyoffer_id, "No buyoffer with this id exists"
     );
@@ -1243,6 +2129,7 @@ ACTION atomicmarket::canceltbuyo(uint64_t buyoffer_id) {
     internal_add_balance(buyoffer_itr->buyer, buyoffer_itr->price);
 
     template_buyoffers.erase(buyoffer_itr);
+    remove_locator(name("tbuyoffer"), buyoffer_id);
 }
 
 ACTION atomicmarket::fulfilltbuyo(
@@ -1251,6 +2138,7 @@ ACTION atomicmarket::fulfilltbuyo(
 ) {
     check(expected_price.is_valid(), "Invalid type expected_price");
 
+    template_buyoffers_t &template_buyoffers = locate_template_buyoffers(buyoffer_id);
     auto buyoffer_itr = template_buyoffers.require_find(buyoffer_id,
         "No buyoffer with this id exists");
 
@@ -1267,60 +2155,60 @@ ACTION atomicmarket::fulfilltbuyo(
     check(buyoffer_itr->price == expected_price,
         "The price of this buyoffer differs from the expected price");
 
-    // Get the last offer on atomic assets. It is expected that in the same transaction an offer
-    // with the memo "tbuyoffer" was made to atomicmarket with the singular asset
-    auto last_offer_itr = --atomicassets::offers.end();
-    // Verify the offer is from the correct account to atomicmarket
-    check(last_offer_itr->sender == seller && last_offer_itr->recipient == get_self(),
-        "The last created AtomicAssets offer must be from the seller to the AtomicMarket contract");
-    // Verify the offer contains exactly the one asset and does not expect anything in return
-    check(last_offer_itr->sender_asset_ids.size() == 1, "The offer must contain exactly one asset");
-    check(last_offer_itr->sender_asset_ids[0] == asset_id,
-        "The offer must contain the asset sold");
-    check(last_offer_itr->recipient_asset_ids.size() == 0,
-        "The last created AtomicAssets offer must not ask for any assets in return");
+    internal_fulfill_template_buyoffer(seller, template_buyoffers, buyoffer_itr, asset_id, taker_marketplace);
+}
 
-    // Verify the memo of the offer to be as expected
-    check(last_offer_itr->memo == "tbuyoffer",
-        "The last created AtomicAssets offer must have the memo \"tbuyoffer\"");
 
-    // It is not checked whether the AtomicAssets offer is valid, because this will be checked in the
-    // acceptoffer action, and if the offer is invalid, the transaction will throw
-    action(
-        permission_level{get_self(), name("active")},
-        atomicassets::ATOMICASSETS_ACCOUNT,
-        name("acceptoffer"),
-        make_tuple(
-            last_offer_itr->offer_id
-        )
-    ).send();
+/**
+* Sells an asset to the template buyoffer with the highest price for the asset's template that uses the
+* symbol of min_price, as long as that price is at least min_price
+* 
+* Like in fulfilltbuyo, the seller needs to create an AtomicAssets offer with only this asset to the
+* AtomicMarket contract with the memo "tbuyoffer" in the same transaction before calling this action
+* 
+* @required_auth seller
+*/
+ACTION atomicmarket::selltobest(
+    name seller,
+    uint64_t asset_id,
+    asset min_price,
+    name taker_marketplace
+) {
+    require_auth(seller);
 
-    internal_transfer_assets(
-        buyoffer_itr->buyer,
-        std::vector<uint64_t> { asset_id },
-        "AtomicMarket Accepted Template Buyoffer - ID # " + to_string(buyoffer_id)
-    );
+    check(min_price.is_valid(), "Invalid type min_price");
 
-    check(is_valid_marketplace(taker_marketplace),
-        "The taker marketplace is not a valid marketplace");
+    auto seller_assets = atomicassets::get_assets(seller);
+    auto asset_itr = seller_assets.require_find(asset_id, "The seller must own the asset sold");
+    check(asset_itr->template_id >= 0, "The sold asset must have a template");
 
-    internal_payout_sale(
-        buyoffer_itr->price,
+    uint64_t template_id = (uint64_t) asset_itr->template_id;
+
+    template_buyoffers_t &template_buyoffers = get_template_buyoffers(asset_itr->collection_name);
+    auto buyoffers_by_template_price = template_buyoffers.get_index <name("templprice")>();
+
+    // The key with the amount UINT64_MAX is the lowest key of the template and symbol, i.e. the highest price
+    auto best_itr = buyoffers_by_template_price.lower_bound(
+        template_buyoffer_price_key(template_id, min_price.symbol, UINT64_MAX));
+    check(best_itr != buyoffers_by_template_price.end()
+        && best_itr->template_id == template_id
+        && best_itr->price.symbol == min_price.symbol,
+        "There is no buyoffer for the template of this asset with the symbol of min_price");
+
+    check(best_itr->price.amount >= min_price.amount,
+        "The price of the best buyoffer is lower than min_price");
+
+    internal_fulfill_template_buyoffer(
         seller,
-        buyoffer_itr->maker_marketplace,
-        taker_marketplace,
-        get_collection_author(buyoffer_itr->collection_name),
-        buyoffer_itr->collection_fee,
-        name("tbuyoffer"),
-        buyoffer_id,
-        "AtomicMarket Template Buyoffer Payout - ID #" + to_string(buyoffer_id)
+        template_buyoffers,
+        template_buyoffers.iterator_to(*best_itr),
+        asset_id,
+        taker_marketplace
     );
-
-    template_buyoffers.erase(buyoffer_itr);
 }
 
 /**
-* Pays the RAM cost for an already existing sale
+* Pays the RAM cost for an already existing sale, including its locator
 */
 ACTION atomicmarket::paysaleram(
     name payer,
@@ -1328,21 +2216,24 @@ ACTION atomicmarket::paysaleram(
 ) {
     require_auth(payer);
 
+    sales_t &sales = locate_sales(sale_id);
     auto sale_itr = sales.require_find(sale_id,
         "No sale with this id exists");
     
     sales_s sale_copy = *sale_itr;
+    fill_extensions(sale_copy);
 
     sales.erase(sale_itr);
 
     sales.emplace(payer, [&](auto &_sale) {
         _sale = sale_copy;
     });
+    set_locator_payer(name("sale"), sale_id, payer);
 }
 
 
 /**
-* Pays the RAM cost for an already existing auction
+* Pays the RAM cost for an already existing auction, including its locator
 */
 ACTION atomicmarket::payauctram(
     name payer,
@@ -1350,21 +2241,24 @@ ACTION atomicmarket::payauctram(
 ) {
     require_auth(payer);
 
+    auctions_t &auctions = locate_auctions(auction_id);
     auto auction_itr = auctions.require_find(auction_id,
         "No auction with this id exists");
     
     auctions_s auction_copy = *auction_itr;
+    fill_extensions(auction_copy);
 
     auctions.erase(auction_itr);
 
     auctions.emplace(payer, [&](auto &_auction) {
         _auction = auction_copy;
     });
+    set_locator_payer(name("auction"), auction_id, payer);
 }
 
 
 /**
-* Pays the RAM cost for an already existing buyoffer
+* Pays the RAM cost for an already existing buyoffer, including its locator
 */
 ACTION atomicmarket::paybuyoram(
     name payer,
@@ -1372,16 +2266,19 @@ ACTION atomicmarket::paybuyoram(
 ) {
     require_auth(payer);
 
+    buyoffers_t &buyoffers = locate_buyoffers(buyoffer_id);
     auto buyoffer_itr = buyoffers.require_find(buyoffer_id,
         "No buyoffer with this id exists");
     
     buyoffers_s buyoffer_copy = *buyoffer_itr;
+    fill_extensions(buyoffer_copy);
 
     buyoffers.erase(buyoffer_itr);
 
     buyoffers.emplace(payer, [&](auto &_buyoffer) {
         _buyoffer = buyoffer_copy;
     });
+    set_locator_payer(name("buyoffer"), buyoffer_id, payer);
 }
 
 
@@ -1418,26 +2315,58 @@ void atomicmarket::receive_asset_transfer(
         return;
     }
 
-    if (memo == "auction") {
-        checksum256 asset_ids_hash = hash_asset_ids(asset_ids);
-        auto auctions_by_hash = auctions.get_index <name("assetidshash")>();
-        auto auction_itr = auctions_by_hash.find(asset_ids_hash);
+    if (listingmemo::has_prefix(memo, listingmemo::AUCTION_PREFIX)) {
+        listingmemo::AUCTION_MEMO auction_memo = listingmemo::parse_auction_memo(memo);
 
-        while (true) {
-            check(auction_itr != auctions_by_hash.end(),
-                "No announced, non-finished auction by the sender for these assets exists");
+        // The RAM is billed to the seller, which is only possible in a notification because the same
+        // amount of the seller's RAM deposit is freed
+        use_ram_deposit(from, MEMO_LISTING_RAM_BYTES + MEMO_LISTING_RAM_BYTES_PER_ASSET * asset_ids.size());
 
-            check(asset_ids_hash == auction_itr->asset_ids_hash(),
-                "No announced, non-finished auction by the sender for these assets exists");
+        // The assets have already been transferred, so atomicassets has checked that the sender owned them
+        // and that they are transferable
+        uint64_t auction_id = internal_create_auction(
+            from,
+            get_collection_of_assets(atomicassets::get_assets(get_self()), asset_ids),
+            asset_ids,
+            auction_memo.starting_bid,
+            auction_memo.duration,
+            auction_memo.maker_marketplace,
+            true
+        );
 
-            if (auction_itr->seller == from && current_time_point().sec_since_epoch() < auction_itr->end_time) {
-                break;
-            }
+        action(
+            permission_level{get_self(), name("active")},
+            get_self(),
+            name("logauctstart"),
+            make_tuple(
+                auction_id
+            )
+        ).send();
+
+    } else if (memo == "auction") {
+        auto is_matching_auction = [&](const auctions_s &auction) {
+            return auction.seller == from && current_time_point().sec_since_epoch() < auction.end_time;
+        };
+
+        name assets_collection_name = atomicassets::get_assets(get_self()).get(asset_ids[0],
+            "No announced, non-finished auction by the sender for these assets exists").collection_name;
+
+        auctions_t *auctions = &get_auctions(assets_collection_name);
+        auto auction_itr = find_listing_by_assets(*auctions, asset_ids, false, is_matching_auction);
 
-            auction_itr++;
+        if (auction_itr == auctions->end()) {
+            // The auction might have been announced before the auctions were scoped by collection
+            auctions = &get_auctions(get_self());
+            auction_itr = find_listing_by_assets(*auctions, asset_ids, true, is_matching_auction);
         }
 
-        auctions_by_hash.modify(auction_itr, same_payer, [&](auto &_auction) {
+        check(auction_itr != auctions->end(),
+            "No announced, non-finished auction by the sender for these assets exists");
+
+        check(!is_unconverted_listing(*auction_itr),
+            "This auction needs to be converted with the convhashes action before it can be started");
+
+        auctions->modify(auction_itr, same_payer, [&](auto &_auction) {
             _auction.assets_transferred = true;
         });
 
@@ -1472,35 +2401,99 @@ void atomicmarket::receive_asset_offer(
         return;
     }
 
-    if (memo == "sale") {
+    if (listingmemo::has_prefix(memo, listingmemo::SALE_PREFIX)) {
         check(recipient_asset_ids.size() == 0, "You must not ask for any assets in return in a sale offer");
 
+        listingmemo::SALE_MEMO sale_memo = listingmemo::parse_sale_memo(memo);
+
+        check(is_valid_marketplace(sale_memo.maker_marketplace),
+            "The maker marketplace is not a valid marketplace");
+
+        // The RAM is billed to the seller, which is only possible in a notification because the same
+        // amount of the seller's RAM deposit is freed
+        use_ram_deposit(sender, MEMO_LISTING_RAM_BYTES + MEMO_LISTING_RAM_BYTES_PER_ASSET * sender_asset_ids.size());
+
+        // atomicassets has already checked that the sender owns the assets and that they are transferable
+        atomicassets::assets_t sender_assets = atomicassets::get_assets(sender);
+
+        NEW_SALE new_sale = internal_create_sale(
+            sender,
+            sender_assets,
+            get_collection_of_assets(sender_assets, sender_asset_ids),
+            sender_asset_ids,
+            sale_memo.listing_price,
+            sale_memo.settlement_symbol,
+            sale_memo.maker_marketplace,
+            consume_counter(name("sale")),
+            offer_id,
+            std::nullopt
+        );
 
-        checksum256 asset_ids_hash = hash_asset_ids(sender_asset_ids);
-
-        auto sales_by_hash = sales.get_index <name("assetidshash")>();
-        auto sale_itr = sales_by_hash.find(asset_ids_hash);
-
-        while (true) {
-            check(sale_itr != sales_by_hash.end(),
-                "No sale was announced by this sender for the offered assets");
-
-            check(asset_ids_hash == sale_itr->asset_ids_hash(),
-                "No sale was announced by this sender for the offered assets");
-
-            if (sale_itr->seller == sender) {
-                break;
-            }
+        action(
+            permission_level{get_self(), name("active")},
+            get_self(),
+            name("lognewsale"),
+            make_tuple(
+                new_sale.sale_id,
+                sender,
+                new_sale.asset_ids,
+                new_sale.listing_price,
+                new_sale.settlement_symbol,
+                sale_memo.maker_marketplace,
+                new_sale.collection_name,
+                new_sale.collection_fee
+            )
+        ).send();
 
-            sale_itr++;
+        action(
+            permission_level{get_self(), name("active")},
+            get_self(),
+            name("logsalestart"),
+            make_tuple(
+                new_sale.sale_id,
+                offer_id
+            )
+        ).send();
+
+    } else if (memo == "sale") {
+        check(recipient_asset_ids.size() == 0, "You must not ask for any assets in return in a sale offer");
+
+
+        auto is_matching_sale = [&](const sales_s &sale) {
+            return sale.seller == sender;
+        };
+
+        name assets_collection_name = atomicassets::get_assets(sender).get(sender_asset_ids[0],
+            "No sale was announced by this sender for the offered assets").collection_name;
+
+        sales_t *sales = &get_sales(assets_collection_name);
+        auto sale_itr = find_listing_by_assets(*sales, sender_asset_ids, false, is_matching_sale);
+        bool is_legacy_sale = false;
+
+        if (sale_itr == sales->end()) {
+            // The sale might have been announced before the sales were scoped by collection
+            is_legacy_sale = true;
+            sales = &get_sales(get_self());
+            sale_itr = find_listing_by_assets(*sales, sender_asset_ids, true, is_matching_sale);
         }
 
+        check(sale_itr != sales->end(),
+            "No sale was announced by this sender for the offered assets");
+
         check(sale_itr->offer_id == -1, "An offer for this sale has already been created");
 
-        sales_by_hash.modify(sale_itr, same_payer, [&](auto &_sale) {
+        check(!is_unconverted_listing(*sale_itr),
+            "This sale needs to be converted with the convhashes action before it can be started");
+
+        sales->modify(sale_itr, same_payer, [&](auto &_sale) {
             _sale.offer_id = offer_id;
         });
 
+        // Sales from before the sales were scoped by collection are not part of the floors
+        if (!is_legacy_sale) {
+            add_to_floors(*sale_itr);
+        }
+
         action(
             permission_level{get_self(), name("active")},
             get_self(),
@@ -1534,6 +2527,33 @@ ACTION atomicmarket::lognewsale(
     require_recipient(seller);
 }
 
+ACTION atomicmarket::lognewsales(
+    name seller,
+    name maker_marketplace,
+    vector <NEW_SALE> sales
+) {
+    require_auth(get_self());
+
+    require_recipient(seller);
+}
+
+ACTION atomicmarket::lognewdutch(
+    uint64_t sale_id,
+    name seller,
+    vector <uint64_t> asset_ids,
+    asset start_price,
+    asset end_price,
+    uint32_t start_time,
+    uint32_t end_time,
+    name maker_marketplace,
+    name collection_name,
+    double collection_fee
+) {
+    require_auth(get_self());
+
+    require_recipient(seller);
+}
+
 ACTION atomicmarket::lognewauct(
     uint64_t auction_id,
     name seller,
@@ -1584,10 +2604,152 @@ ACTION atomicmarket::logauctstart(
     require_auth(get_self());
 }
 
+ACTION atomicmarket::logsaleprice(
+    uint64_t sale_id,
+    asset listing_price,
+    symbol settlement_symbol
+) {
+    require_auth(get_self());
+}
+
+ACTION atomicmarket::logsalesweep(
+    uint64_t swept_sales,
+    uint64_t next_cursor
+) {
+    require_auth(get_self());
+}
+
+
+/**
+* Gets the config singleton
+* It is only read from the table the first time it is needed within an action, all later calls
+* within the same action return the cached copy
+*/
+const atomicmarket::config_s &atomicmarket::get_config() {
+    if (!cached_config.has_value()) {
+        cached_config = config.get();
+
+        if (!cached_config->maker_market_fee_ppm.has_value()) {
+            cached_config->minimum_bid_increase_ppm = fee_to_ppm(cached_config->minimum_bid_increase);
+            cached_config->maker_market_fee_ppm = fee_to_ppm(cached_config->maker_market_fee);
+            cached_config->taker_market_fee_ppm = fee_to_ppm(cached_config->taker_market_fee);
+        }
+        if (!cached_config->delphi_cache_window.has_value()) {
+            cached_config->delphi_cache_window = DEFAULT_DELPHI_CACHE_WINDOW;
+        }
+    }
+    return *cached_config;
+}
+
+
+/**
+* Writes the config singleton and updates the cached copy
+*/
+void atomicmarket::set_config(const config_s &new_config) {
+    config.set(new_config, get_self());
+    cached_config = new_config;
+}
+
+
+/**
+* Gets the sales table of the specified scope
+* The table objects are kept for the rest of the action, so that rows are only read from it once
+*/
+atomicmarket::sales_t &atomicmarket::get_sales(name scope) {
+    return sales_tables.try_emplace(scope.value, get_self(), scope.value).first->second;
+}
+
+atomicmarket::auctions_t &atomicmarket::get_auctions(name scope) {
+    return auctions_tables.try_emplace(scope.value, get_self(), scope.value).first->second;
+}
+
+atomicmarket::buyoffers_t &atomicmarket::get_buyoffers(name scope) {
+    return buyoffers_tables.try_emplace(scope.value, get_self(), scope.value).first->second;
+}
+
+atomicmarket::template_buyoffers_t &atomicmarket::get_template_buyoffers(name scope) {
+    return template_buyoffers_tables.try_emplace(scope.value, get_self(), scope.value).first->second;
+}
+
+
+/**
+* Gets the scope of the table that the listing of the specified type (sale, auction, buyoffer or tbuyoffer)
+* and id is stored in
+* Listings without a locator were created before the tables were scoped and are in the scope of the contract
+*/
+name atomicmarket::get_listing_scope(name listing_type, uint64_t listing_id) {
+    locators_t locators = locators_t(get_self(), listing_type.value);
+
+    auto locator_itr = locators.find(listing_id);
+    return locator_itr != locators.end() ? locator_itr->collection_name : get_self();
+}
+
+atomicmarket::sales_t &atomicmarket::locate_sales(uint64_t sale_id) {
+    return get_sales(get_listing_scope(name("sale"), sale_id));
+}
+
+atomicmarket::auctions_t &atomicmarket::locate_auctions(uint64_t auction_id) {
+    return get_auctions(get_listing_scope(name("auction"), auction_id));
+}
+
+atomicmarket::buyoffers_t &atomicmarket::locate_buyoffers(uint64_t buyoffer_id) {
+    return get_buyoffers(get_listing_scope(name("buyoffer"), buyoffer_id));
+}
+
+atomicmarket::template_buyoffers_t &atomicmarket::locate_template_buyoffers(uint64_t buyoffer_id) {
+    return get_template_buyoffers(get_listing_scope(name("tbuyoffer"), buyoffer_id));
+}
+
+
+void atomicmarket::add_locator(name listing_type, uint64_t listing_id, name collection_name, name ram_payer) {
+    locators_t locators = locators_t(get_self(), listing_type.value);
+
+    locators.emplace(ram_payer, [&](auto &_locator) {
+        _locator.id = listing_id;
+        _locator.collection_name = collection_name;
+    });
+}
+
+/**
+* Bills the locator of a listing to a new RAM payer. Listings without a locator are left as they are
+*/
+void atomicmarket::set_locator_payer(name listing_type, uint64_t listing_id, name ram_payer) {
+    locators_t locators = locators_t(get_self(), listing_type.value);
+
+    auto locator_itr = locators.find(listing_id);
+    if (locator_itr != locators.end()) {
+        locators.modify(locator_itr, ram_payer, [&](auto &_locator) {});
+    }
+}
+
+void atomicmarket::remove_locator(name listing_type, uint64_t listing_id) {
+    locators_t locators = locators_t(get_self(), listing_type.value);
+
+    auto locator_itr = locators.find(listing_id);
+    if (locator_itr != locators.end()) {
+        locators.erase(locator_itr);
+    }
+}
+
 
 name atomicmarket::get_collection_and_check_assets(
     name owner,
     vector <uint64_t> asset_ids
+) {
+    return get_collection_and_check_assets(atomicassets::get_assets(owner), asset_ids);
+}
+
+
+/**
+* Checks that the owner of the provided assets table owns all of the assets, that they are transferable and
+* that they all belong to the same collection, and returns the name of that collection
+* 
+* Taking the assets table allows callers that check multiple listings of the same owner to reuse the rows
+* it has already loaded
+*/
+name atomicmarket::get_collection_and_check_assets(
+    const atomicassets::assets_t &owner_assets,
+    vector <uint64_t> asset_ids
 ) {
     check(asset_ids.size() != 0, "asset_ids needs to contain at least one id");
 
@@ -1597,8 +2759,6 @@ name atomicmarket::get_collection_and_check_assets(
         "The asset_ids must not contain duplicates");
 
 
-    atomicassets::assets_t owner_assets = atomicassets::get_assets(owner);
-
     name assets_collection_name = name("");
     for (uint64_t asset_id : asset_ids) {
         auto asset_itr = owner_assets.require_find(asset_id,
@@ -1624,12 +2784,45 @@ name atomicmarket::get_collection_and_check_assets(
 }
 
 
+/**
+* Gets the collection of assets whose ownership and transferability has already been checked by the
+* atomicassets contract, checking only that they all belong to the same collection
+*/
+name atomicmarket::get_collection_of_assets(
+    const atomicassets::assets_t &owner_assets,
+    const vector <uint64_t> &asset_ids
+) {
+    check(asset_ids.size() != 0, "asset_ids needs to contain at least one id");
+
+    name assets_collection_name = owner_assets.get(asset_ids[0],
+        "The specified account does not own at least one of the assets").collection_name;
+    for (uint64_t asset_id : asset_ids) {
+        check(owner_assets.get(asset_id,
+            "The specified account does not own at least one of the assets").collection_name
+            == assets_collection_name,
+            "The specified asset ids must all belong to the same collection");
+    }
+
+    return assets_collection_name;
+}
+
+
+/**
+* Gets a collection row of the atomicassets contract
+* The row is cached by the collections table object, so repeated calls within the same action
+* only read from the atomicassets table once
+*/
+const atomicassets::collections_s &atomicmarket::get_collection(name collection_name) {
+    return atomicassets::collections.get(collection_name.value,
+        "No collection with this name exists");
+}
+
+
 /**
 * Gets the author of a collection in the atomicassets contract
 */
 name atomicmarket::get_collection_author(name collection_name) {
-    auto collection_itr = atomicassets::collections.find(collection_name.value);
-    return collection_itr->author;
+    return get_collection(collection_name).author;
 }
 
 
@@ -1637,16 +2830,16 @@ name atomicmarket::get_collection_author(name collection_name) {
 * Gets the fee defined by a collection in the atomicassets contract
 */
 double atomicmarket::get_collection_fee(name collection_name) {
-    auto collection_itr = atomicassets::collections.find(collection_name.value);
-    return collection_itr->market_fee;
+    return get_collection(collection_name).market_fee;
 }
 
 
 /**
-* Gets the current value of a counter and increments the counter by 1
+* Gets the current value of a counter and increments the counter by the specified amount, so that the
+* ids from the returned value up to (excluding) the returned value + amount are reserved for the caller
 * If no counter with the specified name exists yet, it is treated as if the counter was 1
 */
-uint64_t atomicmarket::consume_counter(name counter_name) {
+uint64_t atomicmarket::consume_counter(name counter_name, uint64_t amount) {
     uint64_t value;
 
     auto counter_itr = counters.find(counter_name.value);
@@ -1654,12 +2847,12 @@ uint64_t atomicmarket::consume_counter(name counter_name) {
         value = 1; // Starting with 1 instead of 0 because these ids can be front facing
         counters.emplace(get_self(), [&](auto &_counter) {
             _counter.counter_name = counter_name;
-            _counter.counter_value = 2;
+            _counter.counter_value = 1 + amount;
         });
     } else {
         value = counter_itr->counter_value;
         counters.modify(counter_itr, get_self(), [&](auto &_counter) {
-            _counter.counter_value++;
+            _counter.counter_value += amount;
         });
     }
     
@@ -1668,22 +2861,65 @@ uint64_t atomicmarket::consume_counter(name counter_name) {
 
 
 /**
-* Gets the token_contract corresponding to the token_symbol from the config
+* Finds the first sale or auction (depending on the table) for exactly the specified asset ids that
+* the predicate returns true for, or the end of the table if there is none
+* 
+* Single assets are looked up in the asset id index, so that they don't need to be hashed.
+* Single asset rows that were created before that index existed are only found in the asset ids hash index,
+* which is why it is also searched for them if include_unconverted_rows is true
+*/
+template <typename T, typename Predicate>
+typename T::const_iterator atomicmarket::find_listing_by_assets(
+    const T &table,
+    const vector <uint64_t> &asset_ids,
+    bool include_unconverted_rows,
+    Predicate predicate
+) {
+    if (asset_ids.size() == 1) {
+        auto table_by_asset_id = table.template get_index <name("assetid")>();
+        for (auto itr = table_by_asset_id.find(asset_ids[0]);
+            itr != table_by_asset_id.end() && itr->by_asset_id() == asset_ids[0];
+            itr++
+        ) {
+            if (predicate(*itr)) {
+                return table.iterator_to(*itr);
+            }
+        }
+
+        if (!include_unconverted_rows) {
+            return table.end();
+        }
+    }
+
+    checksum256 asset_ids_hash = hash_asset_ids(asset_ids);
+
+    auto table_by_hash = table.template get_index <name("assetidshash")>();
+    for (auto itr = table_by_hash.find(asset_ids_hash);
+        itr != table_by_hash.end() && itr->by_asset_ids_hash() == asset_ids_hash;
+        itr++
+    ) {
+        if (predicate(*itr)) {
+            return table.iterator_to(*itr);
+        }
+    }
+
+    return table.end();
+}
+
+
+/**
+* Gets the token_contract corresponding to the token_symbol from the tokens table
 * Throws if there is no supported token with the specified token_symbol
 */
 name atomicmarket::require_get_supported_token_contract(
     symbol token_symbol
 ) {
-    config_s current_config = config.get();
+    auto token_itr = tokens.find(token_symbol.code().raw());
 
-    for (TOKEN supported_token : current_config.supported_tokens) {
-        if (supported_token.token_symbol == token_symbol) {
-            return supported_token.token_contract;
-        }
-    }
+    check(token_itr != tokens.end() && token_itr->token_symbol == token_symbol,
+        "The specified token symbol is not supported");
 
-    check(false, "The specified token symbol is not supported");
-    return name(""); //To silence the compiler warning
+    return token_itr->token_contract;
 }
 
 
@@ -1695,16 +2931,113 @@ atomicmarket::SYMBOLPAIR atomicmarket::require_get_symbol_pair(
     symbol listing_symbol,
     symbol settlement_symbol
 ) {
-    config_s current_config = config.get();
+    auto symbolpairs_by_symbols = symbolpairs.get_index <name("symbols")>();
+    auto symbol_pair_itr = symbolpairs_by_symbols.require_find(symbol_pair_key(listing_symbol, settlement_symbol),
+        "No symbol pair with the specified listing - settlement symbol combination exists");
+
+    return {
+        .listing_symbol = symbol_pair_itr->listing_symbol,
+        .settlement_symbol = symbol_pair_itr->settlement_symbol,
+        .delphi_pair_name = symbol_pair_itr->delphi_pair_name,
+        .invert_delphi_pair = symbol_pair_itr->invert_delphi_pair
+    };
+}
+
+
+/**
+* Gets the cached median and quoted precision of a delphi pair
+* If the cached values are older than the delphi cache window, if nothing has been cached for the pair
+* yet or if use_latest_datapoint is true, the most recent datapoint and the pair are read from the
+* delphioracle and the cache is updated
+*/
+atomicmarket::delphicache_s atomicmarket::get_delphi_cache(
+    name delphi_pair_name,
+    bool use_latest_datapoint
+) {
+    uint32_t current_time = current_time_point().sec_since_epoch();
+
+    auto cache_itr = delphicache.find(delphi_pair_name.value);
+    if (!use_latest_datapoint && cache_itr != delphicache.end() &&
+        current_time - cache_itr->updated_at <= get_config().delphi_cache_window.value()) {
+        return *cache_itr;
+    }
+
+    auto pair_itr = delphioracle::pairs.require_find(delphi_pair_name.value,
+        "The delphi pair does not exist in the delphi oracle contract");
+
+    delphioracle::datapoints_t datapoints = delphioracle::get_datapoints(delphi_pair_name);
+    auto datapoints_by_timestamp = datapoints.get_index <name("timestamp")>();
+    auto latest_itr = datapoints_by_timestamp.rbegin();
+    check(latest_itr != datapoints_by_timestamp.rend(),
+        "The delphi pair does not have any datapoints");
+
+    if (cache_itr == delphicache.end()) {
+        cache_itr = delphicache.emplace(get_self(), [&](auto &_cache) {
+            _cache.delphi_pair_name = delphi_pair_name;
+            _cache.median = latest_itr->median;
+            _cache.quoted_precision = pair_itr->quoted_precision;
+            _cache.updated_at = current_time;
+        });
+    } else {
+        delphicache.modify(cache_itr, get_self(), [&](auto &_cache) {
+            _cache.median = latest_itr->median;
+            _cache.quoted_precision = pair_itr->quoted_precision;
+            _cache.updated_at = current_time;
+        });
+    }
+
+    return *cache_itr;
+}
+
 
-    for (SYMBOLPAIR symbol_pair : current_config.supported_symbol_pairs) {
-        if (symbol_pair.listing_symbol == listing_symbol && symbol_pair.settlement_symbol == settlement_symbol) {
-            return symbol_pair;
+/**
+* Checks whether one of the most recent datapoints of a delphi pair has the specified median
+* The datapoints are walked newest first through the timestamp index, and at most
+* DELPHI_MEDIAN_LOOKBACK of them are looked at, no matter how many the oracle stores
+*/
+bool atomicmarket::is_recent_delphi_median(
+    name delphi_pair_name,
+    uint64_t delphi_median
+) {
+    delphioracle::datapoints_t datapoints = delphioracle::get_datapoints(delphi_pair_name);
+    auto datapoints_by_timestamp = datapoints.get_index <name("timestamp")>();
+
+    uint64_t checked_datapoints = 0;
+    for (auto itr = datapoints_by_timestamp.rbegin();
+        itr != datapoints_by_timestamp.rend() && checked_datapoints < DELPHI_MEDIAN_LOOKBACK;
+        itr++, checked_datapoints++
+    ) {
+        if (itr->median == delphi_median) {
+            return true;
         }
     }
+    return false;
+}
+
+
+/**
+* Using the price denoted in the listing symbol and the median price provided by the delphioracle,
+* calculates the final price in the settlement token of the symbol pair
+* 
+* The settlement amount is rounded down, which matches the truncation of the previous floating point formula
+*/
+asset atomicmarket::get_delphi_settlement_price(
+    asset listing_price,
+    SYMBOLPAIR symbol_pair,
+    uint64_t delphi_median,
+    uint64_t quoted_precision
+) {
+    uint64_t settlement_price_amount = delphiconversion::convert_price(
+        listing_price.amount,
+        delphi_median,
+        symbol_pair.invert_delphi_pair,
+        quoted_precision,
+        listing_price.symbol.precision(),
+        symbol_pair.settlement_symbol.precision(),
+        delphiconversion::ROUND_DOWN
+    );
 
-    check(false, "No symbol pair with the specified listing - settlement symbol combination exists");
-    return {}; //To silence the compiler warning
+    return asset(settlement_price_amount, symbol_pair.settlement_symbol);
 }
 
 
@@ -1715,14 +3048,11 @@ bool atomicmarket::is_token_supported(
     name token_contract,
     symbol token_symbol
 ) {
-    config_s current_config = config.get();
+    auto token_itr = tokens.find(token_symbol.code().raw());
 
-    for (TOKEN supported_token : current_config.supported_tokens) {
-        if (supported_token.token_contract == token_contract && supported_token.token_symbol == token_symbol) {
-            return true;
-        }
-    }
-    return false;
+    return token_itr != tokens.end()
+        && token_itr->token_contract == token_contract
+        && token_itr->token_symbol == token_symbol;
 }
 
 
@@ -1732,14 +3062,9 @@ bool atomicmarket::is_token_supported(
 bool atomicmarket::is_symbol_supported(
     symbol token_symbol
 ) {
-    config_s current_config = config.get();
+    auto token_itr = tokens.find(token_symbol.code().raw());
 
-    for (TOKEN supported_token : current_config.supported_tokens) {
-        if (supported_token.token_symbol == token_symbol) {
-            return true;
-        }
-    }
-    return false;
+    return token_itr != tokens.end() && token_itr->token_symbol == token_symbol;
 }
 
 
@@ -1750,14 +3075,10 @@ bool atomicmarket::is_symbol_pair_supported(
     symbol listing_symbol,
     symbol settlement_symbol
 ) {
-    config_s current_config = config.get();
+    auto symbolpairs_by_symbols = symbolpairs.get_index <name("symbols")>();
 
-    for (SYMBOLPAIR symbol_pair : current_config.supported_symbol_pairs) {
-        if (symbol_pair.listing_symbol == listing_symbol && symbol_pair.settlement_symbol == settlement_symbol) {
-            return true;
-        }
-    }
-    return false;
+    return symbolpairs_by_symbols.find(symbol_pair_key(listing_symbol, settlement_symbol))
+        != symbolpairs_by_symbols.end();
 }
 
 
@@ -1801,46 +3122,42 @@ void atomicmarket::internal_withdraw_tokens(
 
 
 /**
-* Gives the seller, the marketplaces and the collection their share of the sale price
+* Calculates the shares of the sale price that the marketplaces, the collection and the bonus fee recipients
+* receive. Whatever is left of the sale price after these fee payouts is the seller's cut
 */
-void atomicmarket::internal_payout_sale(
+vector <atomicmarket::FEE_PAYOUT> atomicmarket::get_fee_payouts(
     asset quantity,
-    name seller,
     name maker_marketplace,
     name taker_marketplace,
     name collection_author,
-    double collection_fee,
+    uint32_t collection_fee_ppm,
     name relevant_counter_name,
-    uint64_t relevant_counter_id,
-    string seller_payout_message
+    uint64_t relevant_counter_id
 ) {
-    config_s current_config = config.get();
-
-    struct FEE_PAYOUT {
-        name recipient;
-        uint64_t amount;
-    };
+    const config_s &current_config = get_config();
 
     vector <FEE_PAYOUT> fee_payouts = {};
 
     // Maker market fee
-    auto maker_itr = marketplaces.find(maker_marketplace.value);
+    const marketplaces_s &maker = marketplaces.get(maker_marketplace.value,
+        "The maker marketplace is not a valid marketplace");
     fee_payouts.push_back({
-        .recipient = maker_itr->creator,
-        .amount = (uint64_t)(current_config.maker_market_fee * (double) quantity.amount)
+        .recipient = maker.creator,
+        .amount = apply_fee_ppm(quantity.amount, current_config.maker_market_fee_ppm.value())
     });
 
     // Taker market fee
-    auto taker_itr = marketplaces.find(taker_marketplace.value);
+    const marketplaces_s &taker = marketplaces.get(taker_marketplace.value,
+        "The taker marketplace is not a valid marketplace");
     fee_payouts.push_back({
-        .recipient = taker_itr->creator,
-        .amount = (uint64_t)(current_config.taker_market_fee * (double) quantity.amount)
+        .recipient = taker.creator,
+        .amount = apply_fee_ppm(quantity.amount, current_config.taker_market_fee_ppm.value())
     });
 
     // Collection fee
     fee_payouts.push_back({
         .recipient = collection_author,
-        .amount = (uint64_t)(collection_fee * (double) quantity.amount)
+        .amount = apply_fee_ppm(quantity.amount, collection_fee_ppm)
     });
 
     // Bonus fees
@@ -1864,10 +3181,40 @@ void atomicmarket::internal_payout_sale(
 
         fee_payouts.push_back({
             .recipient = bonusfee_itr->fee_recipient,
-            .amount = (uint64_t)(bonusfee_itr->fee * (double) quantity.amount)
+            .amount = apply_fee_ppm(
+                quantity.amount,
+                bonusfee_itr->fee_ppm.has_value() ? bonusfee_itr->fee_ppm.value() : fee_to_ppm(bonusfee_itr->fee)
+            )
         });
     }
 
+    return fee_payouts;
+}
+
+
+/**
+* Gives the seller, the marketplaces and the collection their share of the sale price
+*/
+void atomicmarket::internal_payout_sale(
+    asset quantity,
+    name seller,
+    name maker_marketplace,
+    name taker_marketplace,
+    name collection_author,
+    uint32_t collection_fee_ppm,
+    name relevant_counter_name,
+    uint64_t relevant_counter_id,
+    string seller_payout_message
+) {
+    vector <FEE_PAYOUT> fee_payouts = get_fee_payouts(
+        quantity,
+        maker_marketplace,
+        taker_marketplace,
+        collection_author,
+        collection_fee_ppm,
+        relevant_counter_name,
+        relevant_counter_id
+    );
 
     asset seller_cut_quantity = quantity;
 
@@ -1895,35 +3242,1030 @@ void atomicmarket::internal_payout_sale(
 
 
 /**
-* Internal function used to add a quantity of a token to an account's balance
-* It is not checked whether the added token is a supported token, this has to be checked before calling this function
+* Checks that a sale can be listed for the listing price and settled in the settlement symbol
 */
-void atomicmarket::internal_add_balance(
-    name owner,
-    asset quantity
+void atomicmarket::check_sale_price(
+    asset listing_price,
+    symbol settlement_symbol
 ) {
-    if (quantity.amount == 0) {
-        return;
-    }
-    check(quantity.amount > 0, "Can't add negative balances");
+    check(listing_price.is_valid(), "Invalid type listing_price");
+    check(settlement_symbol.is_valid(), "Invalid type settlement_symbol");
 
-    auto balance_itr = balances.find(owner.value);
+    if (listing_price.symbol == settlement_symbol) {
+        check(is_symbol_supported(listing_price.symbol), "The specified listing symbol is not supported.");
+    } else {
+        check(is_symbol_pair_supported(listing_price.symbol, settlement_symbol),
+            "The specified listing - settlement symbol combination is not supported");
+    }
 
-    vector <asset> quantities;
-    if (balance_itr == balances.end()) {
-        //No balance table row exists yet
-        quantities = {quantity};
-        balances.emplace(get_self(), [&](auto &_balance) {
-            _balance.owner = owner;
-            _balance.quantities = quantities;
-        });
+    check(listing_price.amount > 0, "The sale price must be greater than zero");
+}
 
-    } else {
-        //A balance table row already exists for owner
-        quantities = balance_itr->quantities;
 
-        bool found_token = false;
-        for (asset &token : quantities) {
+/**
+* Validates a sale listing and creates the sale row for it, billing the RAM to the seller
+* Checking the assets and whether the maker marketplace is valid is left to the caller, which passes the
+* assets table of the seller that it has already read the assets from
+* 
+* offer_id is -1 for sales that are announced before their atomicassets offer is created
+* dutch_price is only set for dutch sales
+*/
+atomicmarket::NEW_SALE atomicmarket::internal_create_sale(
+    name seller,
+    const atomicassets::assets_t &seller_assets,
+    name assets_collection_name,
+    vector <uint64_t> asset_ids,
+    asset listing_price,
+    symbol settlement_symbol,
+    name maker_marketplace,
+    uint64_t sale_id,
+    int64_t offer_id,
+    const std::optional <DUTCH_PRICE> &dutch_price
+) {
+    check_sale_price(listing_price, settlement_symbol);
+
+    sales_t &sales = get_sales(assets_collection_name);
+
+    auto is_sellers_sale = [&](const sales_s &sale) {
+        return sale.seller == seller;
+    };
+    check(find_listing_by_assets(sales, asset_ids, false, is_sellers_sale) == sales.end(),
+        "You have already announced a sale for these assets. You can cancel a sale using the cancelsale action.");
+
+    // Sales from before the sales were scoped by collection are still in the scope of the contract
+    // until they are converted with convscopes
+    sales_t &legacy_sales = get_sales(get_self());
+    check(legacy_sales.begin() == legacy_sales.end() ||
+        find_listing_by_assets(legacy_sales, asset_ids, true, is_sellers_sale) == legacy_sales.end(),
+        "You have already announced a sale for these assets. You can cancel a sale using the cancelsale action.");
+
+    double collection_fee = get_collection_fee(assets_collection_name);
+    check(collection_fee <= atomicassets::MAX_MARKET_FEE,
+        "The collection fee is too high. This should have been prevented by the atomicassets contract");
+
+    auto sale_itr = sales.emplace(seller, [&](auto &_sale) {
+        _sale.sale_id = sale_id;
+        _sale.seller = seller;
+        _sale.asset_ids = asset_ids;
+        _sale.offer_id = offer_id;
+        _sale.listing_price = listing_price;
+        _sale.settlement_symbol = settlement_symbol;
+        _sale.maker_marketplace = maker_marketplace;
+        _sale.collection_name = assets_collection_name;
+        _sale.collection_fee = collection_fee;
+        _sale.collection_fee_ppm = fee_to_ppm(collection_fee);
+        _sale.asset_ids_hash = get_stored_asset_ids_hash(asset_ids);
+        _sale.template_id = get_template_id_of_listing(seller_assets, asset_ids);
+        _sale.dutch_price = dutch_price.value_or(DUTCH_PRICE{});
+    });
+    add_locator(name("sale"), sale_id, assets_collection_name, seller);
+
+    add_to_floors(*sale_itr);
+
+    return {
+        .sale_id = sale_id,
+        .asset_ids = asset_ids,
+        .listing_price = listing_price,
+        .settlement_symbol = settlement_symbol,
+        .collection_name = assets_collection_name,
+        .collection_fee = collection_fee
+    };
+}
+
+
+/**
+* Validates an auction listing, creates the auction row for it billing the RAM to the seller and logs it
+* Checking the assets is left to the caller
+* 
+* assets_transferred is true for auctions that are created when the assets are transferred to the contract
+*/
+uint64_t atomicmarket::internal_create_auction(
+    name seller,
+    name assets_collection_name,
+    vector <uint64_t> asset_ids,
+    asset starting_bid,
+    uint32_t duration,
+    name maker_marketplace,
+    bool assets_transferred
+) {
+    check(starting_bid.is_valid(), "Invalid type starting_bid");
+
+    auctions_t &auctions = get_auctions(assets_collection_name);
+
+    auto is_sellers_auction = [&](const auctions_s &auction) {
+        return auction.seller == seller;
+    };
+    check(find_listing_by_assets(auctions, asset_ids, false, is_sellers_auction) == auctions.end(),
+        "You have already announced an auction for these assets. You can cancel an auction using the cancelauct action.");
+
+    // Auctions from before the auctions were scoped by collection are still in the scope of the contract
+    // until they are converted with convscopes
+    auctions_t &legacy_auctions = get_auctions(get_self());
+    check(legacy_auctions.begin() == legacy_auctions.end() ||
+        find_listing_by_assets(legacy_auctions, asset_ids, true, is_sellers_auction) == legacy_auctions.end(),
+        "You have already announced an auction for these assets. You can cancel an auction using the cancelauct action.");
+
+
+    check(is_symbol_supported(starting_bid.symbol), "The specified starting bid token is not supported.");
+    check(starting_bid.amount > 0, "The starting bid must be greater than zero");
+
+    check(is_valid_marketplace(maker_marketplace), "The maker marketplace is not a valid marketplace");
+
+    double collection_fee = get_collection_fee(assets_collection_name);
+    check(collection_fee <= atomicassets::MAX_MARKET_FEE,
+        "The collection fee is too high. This should have been prevented by the atomicassets contract");
+
+    const config_s &current_config = get_config();
+    check(duration >= current_config.minimum_auction_duration,
+        "The specified duration is shorter than the minimum auction duration");
+    check(duration <= current_config.maximum_auction_duration,
+        "The specified duration is longer than the maximum auction duration");
+
+    uint64_t auction_id = consume_counter(name("auction"));
+
+    auctions.emplace(seller, [&](auto &_auction) {
+        _auction.auction_id = auction_id;
+        _auction.seller = seller;
+        _auction.asset_ids = asset_ids;
+        _auction.end_time = current_time_point().sec_since_epoch() + duration;
+        _auction.assets_transferred = assets_transferred;
+        _auction.current_bid = starting_bid;
+        _auction.current_bidder = name("");
+        _auction.claimed_by_seller = false;
+        _auction.claimed_by_buyer = false;
+        _auction.maker_marketplace = maker_marketplace;
+        _auction.taker_marketplace = name("");
+        _auction.collection_name = assets_collection_name;
+        _auction.collection_fee = collection_fee;
+        _auction.collection_fee_ppm = fee_to_ppm(collection_fee);
+        _auction.asset_ids_hash = get_stored_asset_ids_hash(asset_ids);
+        _auction.max_bid = starting_bid;
+    });
+    add_locator(name("auction"), auction_id, assets_collection_name, seller);
+
+
+    action(
+        permission_level{get_self(), name("active")},
+        get_self(),
+        name("lognewauct"),
+        make_tuple(
+            auction_id,
+            seller,
+            asset_ids,
+            starting_bid,
+            duration,
+            current_time_point().sec_since_epoch() + duration,
+            maker_marketplace,
+            assets_collection_name,
+            collection_fee
+        )
+    ).send();
+
+    return auction_id;
+}
+
+
+/**
+* Frees the specified number of bytes of an account's RAM deposit
+* This allows billing new rows to the account in a notification, because the RAM usage of the account
+* does not increase as long as the new rows take up at most the freed bytes
+*/
+void atomicmarket::use_ram_deposit(
+    name account,
+    uint64_t bytes
+) {
+    auto deposit_itr = ramdeposits.find(account.value);
+    check(deposit_itr != ramdeposits.end() && deposit_itr->padding.size() >= bytes,
+        "Listing with a memo needs a RAM deposit of at least " + to_string(bytes) +
+        " bytes. Use the depositram action first");
+
+    if (deposit_itr->padding.size() == bytes) {
+        ramdeposits.erase(deposit_itr);
+    } else {
+        ramdeposits.modify(deposit_itr, same_payer, [&](auto &_deposit) {
+            _deposit.padding.resize(_deposit.padding.size() - bytes);
+        });
+    }
+}
+
+
+/**
+* Checks if a sale is invalid, meaning that the atomicassets offer for the sale was cancelled or
+* the seller does not own at least one of the assets on sale anymore
+*/
+bool atomicmarket::is_sale_invalid(const sales_s &sale) {
+    if (sale.offer_id != -1) {
+        if (atomicassets::offers.find(sale.offer_id) == atomicassets::offers.end()) {
+            return true;
+        }
+    }
+
+    atomicassets::assets_t seller_assets = atomicassets::get_assets(sale.seller);
+    for (uint64_t asset_id : sale.asset_ids) {
+        if (seller_assets.find(asset_id) == seller_assets.end()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**
+* Erases a sale, declining the atomicassets offer for the sale if it still exists
+* Returns the iterator to the sale following the erased sale
+*/
+atomicmarket::sales_t::const_iterator atomicmarket::internal_remove_sale(
+    sales_t &sales,
+    sales_t::const_iterator sale_itr
+) {
+    if (sale_itr->offer_id != -1) {
+        if (atomicassets::offers.find(sale_itr->offer_id) != atomicassets::offers.end()) {
+            //Cancels the atomicassets offer for this sale for convenience
+            action(
+                permission_level{get_self(), name("active")},
+                atomicassets::ATOMICASSETS_ACCOUNT,
+                name("declineoffer"),
+                make_tuple(
+                    sale_itr->offer_id
+                )
+            ).send();
+        }
+    }
+
+    sales_s removed_sale = *sale_itr;
+
+    auto next_sale_itr = sales.erase(sale_itr);
+    remove_locator(name("sale"), removed_sale.sale_id);
+    remove_from_floors(removed_sale);
+
+    return next_sale_itr;
+}
+
+
+/**
+* Places a bid that can be automatically raised up to max_bid
+* For normal bids, bid and max_bid are the same
+* 
+* The current bidder's escrowed maximum bid is compared to the new maximum bid. If the current bidder has
+* escrowed more than the current bid and at least as much as the new maximum bid, the current bidder stays
+* the highest bidder and the current bid is raised just enough to beat the new maximum bid. Otherwise the
+* new bidder becomes the highest bidder with a bid that is just enough to beat the previous maximum bid
+* 
+* The current bidder can raise their maximum bid without changing the current bid. If they also raise the
+* current bid, the minimum bid increase applies like for any other bid
+*/
+void atomicmarket::internal_place_bid(
+    name bidder,
+    auctions_t &auctions,
+    auctions_t::const_iterator auction_itr,
+    asset bid,
+    asset max_bid,
+    name taker_marketplace
+) {
+    check(bidder != auction_itr->seller, "You can't bid on your own auction");
+
+    check(auction_itr->assets_transferred,
+        "The auction is not yet active. The seller first needs to transfer the asset to the atomicmarket account");
+
+    check(current_time_point().sec_since_epoch() < auction_itr->end_time,
+        "The auction is already finished");
+
+    check(!is_unconverted_listing(*auction_itr),
+        "This auction needs to be converted with the convhashes action before it can be bid on");
+
+    check(bid.symbol == auction_itr->current_bid.symbol && max_bid.symbol == bid.symbol,
+        "The bid uses a different symbol than the current auction bid");
+
+    check(max_bid.amount >= bid.amount, "The maximum bid must be at least as high as the bid");
+
+    check(is_valid_marketplace(taker_marketplace), "The taker marketplace is not a valid marketplace");
+
+    const config_s &current_config = get_config();
+    uint32_t minimum_bid_increase_ppm = current_config.minimum_bid_increase_ppm.value();
+
+    asset escrowed_bid = get_escrowed_bid(*auction_itr);
+
+    asset new_current_bid = auction_itr->current_bid;
+    name new_current_bidder = auction_itr->current_bidder;
+    asset new_max_bid = escrowed_bid;
+    name new_taker_marketplace = auction_itr->taker_marketplace;
+
+    if (auction_itr->current_bidder == bidder) {
+        check(max_bid.amount > escrowed_bid.amount,
+            "You already are the highest bidder. A new bid needs to be higher than your maximum bid");
+
+        if (bid.amount > auction_itr->current_bid.amount) {
+            check((uint128_t) bid.amount * FEE_PPM_SCALE >=
+                  (uint128_t) auction_itr->current_bid.amount * (FEE_PPM_SCALE + minimum_bid_increase_ppm),
+                "The relative increase is less than the minimum bid increase specified in the config");
+        }
+
+        internal_decrease_balance(
+            bidder,
+            max_bid - escrowed_bid
+        );
+
+        new_current_bid = std::max(auction_itr->current_bid, bid);
+        new_max_bid = max_bid;
+        new_taker_marketplace = taker_marketplace;
+
+    } else {
+        if (auction_itr->current_bidder == name("")) {
+            check(bid.amount >= auction_itr->current_bid.amount,
+                "The bid must be at least as high as the minimum bid");
+        } else {
+            check((uint128_t) bid.amount * FEE_PPM_SCALE >=
+                  (uint128_t) auction_itr->current_bid.amount * (FEE_PPM_SCALE + minimum_bid_increase_ppm),
+                "The relative increase is less than the minimum bid increase specified in the config");
+        }
+
+        bool is_outbid = auction_itr->current_bidder == name("")
+            || escrowed_bid.amount == auction_itr->current_bid.amount
+            || max_bid.amount > escrowed_bid.amount;
+
+        if (is_outbid) {
+            if (auction_itr->current_bidder != name("")) {
+                internal_add_balance(
+                    auction_itr->current_bidder,
+                    escrowed_bid
+                );
+
+                new_current_bid.amount = std::max(bid.amount, std::min(
+                    max_bid.amount,
+                    (int64_t) get_next_bid_amount(escrowed_bid.amount, minimum_bid_increase_ppm)
+                ));
+            } else {
+                new_current_bid = bid;
+            }
+
+            internal_decrease_balance(
+                bidder,
+                max_bid
+            );
+
+            new_current_bidder = bidder;
+            new_max_bid = max_bid;
+            new_taker_marketplace = taker_marketplace;
+
+        } else {
+            //The proxy bid of the current bidder answers the new bid, which therefore never gets escrowed
+            new_current_bid.amount = std::min(
+                escrowed_bid.amount,
+                (int64_t) get_next_bid_amount(max_bid.amount, minimum_bid_increase_ppm)
+            );
+        }
+    }
+
+    auctions.modify(auction_itr, same_payer, [&](auto &_auction) {
+        _auction.current_bid = new_current_bid;
+        _auction.current_bidder = new_current_bidder;
+        _auction.taker_marketplace = new_taker_marketplace;
+        _auction.end_time = std::max(
+            _auction.end_time,
+            current_time_point().sec_since_epoch() + current_config.auction_reset_duration
+        );
+        _auction.max_bid = new_max_bid;
+    });
+}
+
+
+/**
+* Pays out the highest bid of an auction like a sale and refunds the part of the highest bidder's
+* escrowed maximum bid that was not needed
+*/
+void atomicmarket::internal_payout_auction(const auctions_s &auction) {
+    internal_payout_sale(
+        auction.current_bid,
+        auction.seller,
+        auction.maker_marketplace,
+        auction.taker_marketplace,
+        get_collection_author(auction.collection_name),
+        get_collection_fee_ppm(auction),
+        name("auction"),
+        auction.auction_id,
+        "AtomicMarket Auction Payout - ID #" + to_string(auction.auction_id)
+    );
+
+    asset escrowed_bid = get_escrowed_bid(auction);
+    if (escrowed_bid.amount > auction.current_bid.amount) {
+        internal_add_balance(
+            auction.current_bidder,
+            escrowed_bid - auction.current_bid
+        );
+    }
+}
+
+
+/**
+* Pays out the highest bid of a finished auction and transfers the assets to the highest bidder,
+* skipping the sides that have already been claimed, and then erases the auction
+*/
+void atomicmarket::internal_settle_auction(
+    auctions_t &auctions,
+    auctions_t::const_iterator auction_itr
+) {
+    uint64_t auction_id = auction_itr->auction_id;
+
+    if (!auction_itr->claimed_by_seller) {
+        internal_payout_auction(*auction_itr);
+    }
+
+    if (!auction_itr->claimed_by_buyer) {
+        internal_transfer_assets(
+            auction_itr->current_bidder,
+            auction_itr->asset_ids,
+            "AtomicMarket Won Auction - ID # " + to_string(auction_id)
+        );
+    }
+
+    auctions.erase(auction_itr);
+    remove_locator(name("auction"), auction_id);
+}
+
+
+/**
+* Throws if the asset ids, listing price or settlement symbol of the sale differ from the asserted ones
+*/
+void atomicmarket::internal_assert_sale(
+    uint64_t sale_id,
+    const vector <uint64_t> &asset_ids_to_assert,
+    asset listing_price_to_assert,
+    symbol settlement_symbol_to_assert
+) {
+    check(listing_price_to_assert.is_valid(), "Invalid type listing_price_to_assert");
+    check(settlement_symbol_to_assert.is_valid(), "Invalid type settlement_symbol_to_assert");
+
+    sales_t &sales = locate_sales(sale_id);
+    auto sale_itr = sales.require_find(sale_id,
+        ("No sale with this sale_id exists - " + to_string(sale_id)).c_str());
+
+    check(are_same_asset_ids(asset_ids_to_assert, sale_itr->asset_ids),
+        ("The asset ids to assert differ from the asset ids of this sale - " + to_string(sale_id)).c_str());
+
+    check(listing_price_to_assert == sale_itr->listing_price,
+        ("The listing price to assert differs from the listing price of this sale - " + to_string(sale_id)).c_str());
+
+    check(settlement_symbol_to_assert == sale_itr->settlement_symbol,
+        ("The settlement symbol to assert differs from the settlement symbol of this sale - "
+        + to_string(sale_id)).c_str());
+}
+
+
+/**
+* Throws if the asset ids of the auction differ from the asserted ones
+*/
+void atomicmarket::internal_assert_auction(uint64_t auction_id, const vector <uint64_t> &asset_ids_to_assert) {
+    auctions_t &auctions = locate_auctions(auction_id);
+    auto auction_itr = auctions.require_find(auction_id,
+        ("No auction with this auction_id exists - " + to_string(auction_id)).c_str());
+
+    check(are_same_asset_ids(asset_ids_to_assert, auction_itr->asset_ids),
+        ("The asset ids to assert differ from the asset ids of this auction - " + to_string(auction_id)).c_str());
+}
+
+
+/**
+* Fills a template buyoffer with an asset of the seller: the AtomicAssets offer of the seller is accepted,
+* the asset is transferred to the buyer, the price is paid out and the buyoffer is erased
+* Checking that the asset has the template of the buyoffer is left to the caller
+*/
+void atomicmarket::internal_fulfill_template_buyoffer(
+    name seller,
+    template_buyoffers_t &template_buyoffers,
+    template_buyoffers_t::const_iterator buyoffer_itr,
+    uint64_t asset_id,
+    name taker_marketplace
+) {
+    uint64_t buyoffer_id = buyoffer_itr->buyoffer_id;
+
+    // Get the last offer on atomic assets. It is expected that in the same transaction an offer
+    // with the memo "tbuyoffer" was made to atomicmarket with the singular asset
+    auto last_offer_itr = --atomicassets::offers.end();
+    // Verify the offer is from the correct account to atomicmarket
+    check(last_offer_itr->sender == seller && last_offer_itr->recipient == get_self(),
+        "The last created AtomicAssets offer must be from the seller to the AtomicMarket contract");
+    // Verify the offer contains exactly the one asset and does not expect anything in return
+    check(last_offer_itr->sender_asset_ids.size() == 1, "The offer must contain exactly one asset");
+    check(last_offer_itr->sender_asset_ids[0] == asset_id,
+        "The offer must contain the asset sold");
+    check(last_offer_itr->recipient_asset_ids.size() == 0,
+        "The last created AtomicAssets offer must not ask for any assets in return");
+
+    // Verify the memo of the offer to be as expected
+    check(last_offer_itr->memo == "tbuyoffer",
+        "The last created AtomicAssets offer must have the memo \"tbuyoffer\"");
+
+    // It is not checked whether the AtomicAssets offer is valid, because this will be checked in the
+    // acceptoffer action, and if the offer is invalid, the transaction will throw
+    action(
+        permission_level{get_self(), name("active")},
+        atomicassets::ATOMICASSETS_ACCOUNT,
+        name("acceptoffer"),
+        make_tuple(
+            last_offer_itr->offer_id
+        )
+    ).send();
+
+    internal_transfer_assets(
+        buyoffer_itr->buyer,
+        std::vector<uint64_t> { asset_id },
+        "AtomicMarket Accepted Template Buyoffer - ID # " + to_string(buyoffer_id)
+    );
+
+    check(is_valid_marketplace(taker_marketplace),
+        "The taker marketplace is not a valid marketplace");
+
+    internal_payout_sale(
+        buyoffer_itr->price,
+        seller,
+        buyoffer_itr->maker_marketplace,
+        taker_marketplace,
+        get_collection_author(buyoffer_itr->collection_name),
+        get_collection_fee_ppm(*buyoffer_itr),
+        name("tbuyoffer"),
+        buyoffer_id,
+        "AtomicMarket Template Buyoffer Payout - ID #" + to_string(buyoffer_id)
+    );
+
+    template_buyoffers.erase(buyoffer_itr);
+    remove_locator(name("tbuyoffer"), buyoffer_id);
+}
+
+
+/**
+* Completes the purchase of a sale for the specified price
+* The price is deducted from the buyer's balance and paid out, the atomicassets offer of the sale is
+* accepted, the assets are transferred to the buyer and the sale is erased
+*/
+void atomicmarket::internal_purchase_sale(
+    name buyer,
+    sales_t &sales,
+    sales_t::const_iterator sale_itr,
+    asset sale_price,
+    name taker_marketplace
+) {
+    check(buyer != sale_itr->seller, "You can't purchase your own sale");
+
+    check(sale_itr->offer_id != -1,
+        "This sale is not active yet. The seller first has to create an atomicasset offer for this asset");
+
+    check(atomicassets::offers.find(sale_itr->offer_id) != atomicassets::offers.end(),
+        "The seller cancelled the atomicassets offer related to this sale");
+
+    check(is_valid_marketplace(taker_marketplace), "The taker marketplace is not a valid marketplace");
+
+
+    uint64_t sale_id = sale_itr->sale_id;
+
+    internal_decrease_balance(
+        buyer,
+        sale_price
+    );
+
+    internal_payout_sale(
+        sale_price,
+        sale_itr->seller,
+        sale_itr->maker_marketplace,
+        taker_marketplace,
+        get_collection_author(sale_itr->collection_name),
+        get_collection_fee_ppm(*sale_itr),
+        name("sale"),
+        sale_id,
+        "AtomicMarket Sale Payout - ID #" + to_string(sale_id)
+    );
+
+    action(
+        permission_level{get_self(), name("active")},
+        atomicassets::ATOMICASSETS_ACCOUNT,
+        name("acceptoffer"),
+        make_tuple(
+            sale_itr->offer_id
+        )
+    ).send();
+
+    internal_transfer_assets(
+        buyer,
+        sale_itr->asset_ids,
+        "AtomicMarket Purchased Sale - ID # " + to_string(sale_id)
+    );
+
+    sales_s purchased_sale = *sale_itr;
+
+    sales.erase(sale_itr);
+    remove_locator(name("sale"), sale_id);
+    remove_from_floors(purchased_sale);
+}
+
+
+/**
+* Adds a sale to a cart: the price and the fees of the sale are added to the totals of the cart,
+* the atomicassets offer of the sale is accepted and the sale is erased
+* The totals are settled with settle_cart once all sales have been added
+*/
+void atomicmarket::add_to_cart(
+    CART &cart,
+    name buyer,
+    sales_t &sales,
+    sales_t::const_iterator sale_itr,
+    name taker_marketplace
+) {
+    uint64_t sale_id = sale_itr->sale_id;
+
+    check(buyer != sale_itr->seller, "You can't purchase your own sale");
+
+    check(sale_itr->offer_id != -1,
+        ("This sale is not active yet - " + to_string(sale_id)).c_str());
+
+    check(atomicassets::offers.find(sale_itr->offer_id) != atomicassets::offers.end(),
+        ("The seller cancelled the atomicassets offer related to this sale - " + to_string(sale_id)).c_str());
+
+    check(sale_itr->listing_price.symbol == sale_itr->settlement_symbol,
+        ("Sales using a delphi pair can't be purchased in a cart - " + to_string(sale_id)).c_str());
+
+    asset sale_price = sale_itr->get_price_at(current_time_point().sec_since_epoch());
+    add_to_quantities(cart.buyer_total, sale_price);
+
+    add_payout_to_cart(
+        cart,
+        sale_price,
+        sale_itr->seller,
+        sale_itr->maker_marketplace,
+        taker_marketplace,
+        get_collection_author(sale_itr->collection_name),
+        get_collection_fee_ppm(*sale_itr),
+        name("sale"),
+        sale_id
+    );
+
+    action(
+        permission_level{get_self(), name("active")},
+        atomicassets::ATOMICASSETS_ACCOUNT,
+        name("acceptoffer"),
+        make_tuple(
+            sale_itr->offer_id
+        )
+    ).send();
+
+    cart.asset_ids.insert(cart.asset_ids.end(), sale_itr->asset_ids.begin(), sale_itr->asset_ids.end());
+
+    sales_s purchased_sale = *sale_itr;
+
+    sales.erase(sale_itr);
+    remove_locator(name("sale"), sale_id);
+    remove_from_floors(purchased_sale);
+}
+
+
+/**
+* Adds the fees of a payout to the fee totals of a cart and the rest to the seller's total,
+* like internal_payout_sale does for a single payout
+*/
+void atomicmarket::add_payout_to_cart(
+    CART &cart,
+    asset quantity,
+    name seller,
+    name maker_marketplace,
+    name taker_marketplace,
+    name collection_author,
+    uint32_t collection_fee_ppm,
+    name relevant_counter_name,
+    uint64_t relevant_counter_id
+) {
+    vector <FEE_PAYOUT> fee_payouts = get_fee_payouts(
+        quantity,
+        maker_marketplace,
+        taker_marketplace,
+        collection_author,
+        collection_fee_ppm,
+        relevant_counter_name,
+        relevant_counter_id
+    );
+
+    asset seller_cut_quantity = quantity;
+    for (const FEE_PAYOUT &fee_payout : fee_payouts) {
+        asset fee_payout_quantity = asset(fee_payout.amount, quantity.symbol);
+        add_to_quantities(cart.fee_totals[fee_payout.recipient], fee_payout_quantity);
+        seller_cut_quantity -= fee_payout_quantity;
+    }
+    add_to_quantities(cart.seller_totals[seller], seller_cut_quantity);
+}
+
+
+/**
+* Settles the totals of a cart: the total price is deducted from the buyer's balance at once, the cart
+* is paid out with pay_out_cart and all assets are transferred to the buyer at once
+*/
+void atomicmarket::settle_cart(
+    const CART &cart,
+    name buyer,
+    string seller_payout_memo,
+    string asset_transfer_memo
+) {
+    internal_decrease_balances(buyer, cart.buyer_total);
+
+    pay_out_cart(cart, seller_payout_memo);
+
+    internal_transfer_assets(
+        buyer,
+        cart.asset_ids,
+        asset_transfer_memo
+    );
+}
+
+
+/**
+* Pays out the totals of a cart: the fees are added to the balance of each fee recipient at once and
+* each seller receives one token transfer (per token) for all of their payouts
+*/
+void atomicmarket::pay_out_cart(
+    const CART &cart,
+    string seller_payout_memo
+) {
+    for (const auto &[recipient, quantities] : cart.fee_totals) {
+        internal_add_balances(recipient, quantities);
+    }
+
+    // The sellers' cuts are transferred directly, without being added to their balances first
+    for (const auto &[seller, quantities] : cart.seller_totals) {
+        for (const asset &quantity : quantities) {
+            if (quantity.amount == 0) {
+                continue;
+            }
+
+            action(
+                permission_level{get_self(), name("active")},
+                require_get_supported_token_contract(quantity.symbol),
+                name("transfer"),
+                make_tuple(
+                    get_self(),
+                    seller,
+                    quantity,
+                    seller_payout_memo
+                )
+            ).send();
+        }
+    }
+}
+
+
+/**
+* Gets the template id of the asset of a single asset listing, or -1 if the listing is a bundle,
+* the asset has no template or the owner does not own the asset
+*/
+int32_t atomicmarket::get_template_id_of_listing(name owner, const vector <uint64_t> &asset_ids) {
+    if (asset_ids.size() != 1) {
+        return -1;
+    }
+
+    return get_template_id_of_listing(atomicassets::get_assets(owner), asset_ids);
+}
+
+
+/**
+* Same as above, but reusing an assets table of the owner whose rows have already been loaded
+*/
+int32_t atomicmarket::get_template_id_of_listing(
+    const atomicassets::assets_t &owner_assets,
+    const vector <uint64_t> &asset_ids
+) {
+    if (asset_ids.size() != 1) {
+        return -1;
+    }
+
+    auto asset_itr = owner_assets.find(asset_ids[0]);
+    return asset_itr != owner_assets.end() ? asset_itr->template_id : -1;
+}
+
+
+/**
+* Fills the binary extensions of a row that was written before they existed from its legacy columns
+* CDT serializes an empty binary extension as the default value of its type, so this needs to be called
+* before such a row is written again. Otherwise a collection fee of 0 and empty keys would be stored
+*/
+void atomicmarket::fill_extensions(sales_s &sale) {
+    sale.collection_fee_ppm = get_collection_fee_ppm(sale);
+    if (!sale.asset_ids_hash.has_value()) {
+        sale.asset_ids_hash = get_stored_asset_ids_hash(sale.asset_ids);
+    }
+    if (!sale.template_id.has_value()) {
+        sale.template_id = get_template_id_of_listing(sale.seller, sale.asset_ids);
+    }
+    if (!sale.dutch_price.has_value()) {
+        sale.dutch_price = DUTCH_PRICE{};
+    }
+}
+
+void atomicmarket::fill_extensions(auctions_s &auction) {
+    auction.collection_fee_ppm = get_collection_fee_ppm(auction);
+    if (!auction.asset_ids_hash.has_value()) {
+        auction.asset_ids_hash = get_stored_asset_ids_hash(auction.asset_ids);
+    }
+    auction.max_bid = get_escrowed_bid(auction);
+}
+
+void atomicmarket::fill_extensions(buyoffers_s &buyoffer) {
+    buyoffer.collection_fee_ppm = get_collection_fee_ppm(buyoffer);
+}
+
+void atomicmarket::fill_extensions(template_buyoffer_s &buyoffer) {
+    buyoffer.collection_fee_ppm = get_collection_fee_ppm(buyoffer);
+}
+
+void atomicmarket::fill_extensions(bonusfees_s &bonusfee) {
+    if (!bonusfee.fee_ppm.has_value()) {
+        bonusfee.fee_ppm = fee_to_ppm(bonusfee.fee);
+    }
+}
+
+
+/**
+* Finds the cheapest valid sale in the sales table of a collection for the template (or for the whole
+* collection if template_id is -1) that is settled in the settlement symbol
+* 
+* Only the FLOOR_SEARCH_LIMIT cheapest sales are checked. If none of them is valid, no floor is returned
+* and the floor is set again by the next sale that becomes active
+*/
+std::optional <atomicmarket::FLOOR> atomicmarket::find_floor(
+    sales_t &sales,
+    int32_t template_id,
+    symbol settlement_symbol
+) {
+    auto search_index = [&](auto sales_index, auto first_key, auto end_key, auto get_key) -> std::optional <FLOOR> {
+        uint64_t row_count = 0;
+        for (auto sale_itr = sales_index.lower_bound(first_key);
+            sale_itr != sales_index.end() && get_key(*sale_itr) < end_key && row_count < FLOOR_SEARCH_LIMIT;
+            sale_itr++
+        ) {
+            row_count++;
+            if (sale_itr->offer_id != -1 && !is_sale_invalid(*sale_itr)) {
+                return FLOOR{.sale_id = sale_itr->sale_id, .price = sale_itr->listing_price};
+            }
+        }
+        return std::nullopt;
+    };
+
+    if (template_id == -1) {
+        return search_index(
+            sales.get_index <name("price")>(),
+            sale_price_key(settlement_symbol, 0),
+            sale_price_key(settlement_symbol, UINT64_MAX),
+            [](const sales_s &sale) { return sale.by_price(); }
+        );
+    } else {
+        return search_index(
+            sales.get_index <name("templprice")>(),
+            sale_template_price_key(template_id, settlement_symbol, 0),
+            sale_template_price_key(template_id, settlement_symbol, UINT64_MAX),
+            [](const sales_s &sale) { return sale.by_template_price(); }
+        );
+    }
+}
+
+
+/**
+* Updates the floors of the collection and the template of a sale that has become active or whose price
+* has changed, in case the sale is cheaper than the current floor
+*/
+void atomicmarket::add_to_floors(const sales_s &sale) {
+    if (sale.offer_id == -1 || !sale.has_fixed_price()) {
+        return;
+    }
+
+    floors_t floors = floors_t(get_self(), sale.collection_name.value);
+
+    vector <int32_t> template_ids = {-1};
+    if (sale.get_template_id() != -1) {
+        template_ids.push_back(sale.get_template_id());
+    }
+
+    for (int32_t template_id : template_ids) {
+        FLOOR new_floor = {.sale_id = sale.sale_id, .price = sale.listing_price};
+
+        auto floor_itr = floors.find((uint32_t) template_id);
+        if (floor_itr == floors.end()) {
+            floors.emplace(get_self(), [&](auto &_floor) {
+                _floor.template_id = template_id;
+                _floor.floors = {new_floor};
+            });
+            continue;
+        }
+
+        floors.modify(floor_itr, get_self(), [&](auto &_floor) {
+            for (FLOOR &floor : _floor.floors) {
+                if (floor.price.symbol == new_floor.price.symbol) {
+                    if (new_floor.price.amount < floor.price.amount) {
+                        floor = new_floor;
+                    }
+                    return;
+                }
+            }
+            _floor.floors.push_back(new_floor);
+        });
+    }
+}
+
+
+/**
+* Recalculates the floors that a sale was the floor of, after the sale has been erased or its price
+* has been changed
+* Only the floors of the collection and the template of the sale are affected
+*/
+void atomicmarket::remove_from_floors(const sales_s &removed_sale) {
+    if (removed_sale.offer_id == -1 || !removed_sale.has_fixed_price()) {
+        return;
+    }
+
+    floors_t floors = floors_t(get_self(), removed_sale.collection_name.value);
+    sales_t &sales = get_sales(removed_sale.collection_name);
+
+    vector <int32_t> template_ids = {-1};
+    if (removed_sale.get_template_id() != -1) {
+        template_ids.push_back(removed_sale.get_template_id());
+    }
+
+    for (int32_t template_id : template_ids) {
+        auto floor_itr = floors.find((uint32_t) template_id);
+        if (floor_itr == floors.end()) {
+            continue;
+        }
+
+        bool was_floor = false;
+        vector <FLOOR> updated_floors = {};
+        for (const FLOOR &floor : floor_itr->floors) {
+            if (floor.sale_id != removed_sale.sale_id) {
+                updated_floors.push_back(floor);
+                continue;
+            }
+
+            was_floor = true;
+            std::optional <FLOOR> new_floor = find_floor(sales, template_id, floor.price.symbol);
+            if (new_floor.has_value()) {
+                updated_floors.push_back(new_floor.value());
+            }
+        }
+
+        if (!was_floor) {
+            continue;
+        }
+
+        if (updated_floors.size() == 0) {
+            floors.erase(floor_itr);
+        } else {
+            floors.modify(floor_itr, get_self(), [&](auto &_floor) {
+                _floor.floors = updated_floors;
+            });
+        }
+    }
+}
+
+
+/**
+* Internal function used to add a quantity of a token to an account's balance
+* It is not checked whether the added token is a supported token, this has to be checked before calling this function
+*/
+void atomicmarket::internal_add_balance(
+    name owner,
+    asset quantity
+) {
+    internal_add_balances(owner, {quantity});
+}
+
+
+/**
+* Internal function used to add quantities of (possibly different) tokens to an account's balance
+* with a single write to the balances table
+* It is not checked whether the added tokens are supported tokens, this has to be checked before calling this function
+*/
+void atomicmarket::internal_add_balances(
+    name owner,
+    vector <asset> quantities_to_add
+) {
+    bool has_nonzero_quantity = false;
+    for (const asset &quantity : quantities_to_add) {
+        check(quantity.amount >= 0, "Can't add negative balances");
+        if (quantity.amount != 0) {
+            has_nonzero_quantity = true;
+        }
+    }
+    if (!has_nonzero_quantity) {
+        return;
+    }
+
+    auto balance_itr = balances.find(owner.value);
+
+    vector <asset> quantities = {};
+    if (balance_itr != balances.end()) {
+        quantities = balance_itr->quantities;
+    }
+
+    for (const asset &quantity : quantities_to_add) {
+        if (quantity.amount == 0) {
+            continue;
+        }
+
+        bool found_token = false;
+        for (asset &token : quantities) {
             if (token.symbol == quantity.symbol) {
                 //If the owner already has a balance for the token, this balance is increased
                 found_token = true;
@@ -1936,7 +4278,16 @@ void atomicmarket::internal_add_balance(
             //If the owner does not already have a balance for the token, it is added to the vector
             quantities.push_back(quantity);
         }
+    }
 
+    if (balance_itr == balances.end()) {
+        //No balance table row exists yet
+        balances.emplace(get_self(), [&](auto &_balance) {
+            _balance.owner = owner;
+            _balance.quantities = quantities;
+        });
+    } else {
+        //A balance table row already exists for owner
         balances.modify(balance_itr, get_self(), [&](auto &_balance) {
             _balance.quantities = quantities;
         });
@@ -1952,26 +4303,42 @@ void atomicmarket::internal_add_balance(
 void atomicmarket::internal_decrease_balance(
     name owner,
     asset quantity
+) {
+    internal_decrease_balances(owner, {quantity});
+}
+
+
+/**
+* Internal function used to deduct quantities of (possibly different) tokens from an account's balance
+* with a single write to the balances table
+* If the account has less than any of these quantities in his balance, this function will cause the
+* transaction to fail
+*/
+void atomicmarket::internal_decrease_balances(
+    name owner,
+    vector <asset> quantities_to_decrease
 ) {
     auto balance_itr = balances.require_find(owner.value,
         "The specified account does not have a balance table row");
 
     vector <asset> quantities = balance_itr->quantities;
-    bool found_token = false;
-    for (auto itr = quantities.begin(); itr != quantities.end(); itr++) {
-        if (itr->symbol == quantity.symbol) {
-            found_token = true;
-            check(itr->amount >= quantity.amount,
-                "The specified account's balance is lower than the specified quantity");
-            itr->amount -= quantity.amount;
-            if (itr->amount == 0) {
-                quantities.erase(itr);
+    for (const asset &quantity : quantities_to_decrease) {
+        bool found_token = false;
+        for (auto itr = quantities.begin(); itr != quantities.end(); itr++) {
+            if (itr->symbol == quantity.symbol) {
+                found_token = true;
+                check(itr->amount >= quantity.amount,
+                    "The specified account's balance is lower than the specified quantity");
+                itr->amount -= quantity.amount;
+                if (itr->amount == 0) {
+                    quantities.erase(itr);
+                }
+                break;
             }
-            break;
         }
+        check(found_token,
+            "The specified account does not have a balance for the symbol specified in the quantity");
     }
-    check(found_token,
-        "The specified account does not have a balance for the symbol specified in the quantity");
 
     //Updating the balances table
     if (quantities.size() > 0) {
@@ -1984,6 +4351,23 @@ void atomicmarket::internal_decrease_balance(
 }
 
 
+/**
+* Adds a quantity to the entry of a vector of assets that has the same symbol, or appends it if there is none
+*/
+void atomicmarket::add_to_quantities(
+    vector <asset> &quantities,
+    asset quantity
+) {
+    for (asset &existing_quantity : quantities) {
+        if (existing_quantity.symbol == quantity.symbol) {
+            existing_quantity.amount += quantity.amount;
+            return;
+        }
+    }
+    quantities.push_back(quantity);
+}
+
+
 void atomicmarket::internal_transfer_assets(
     name to,
     vector <uint64_t> asset_ids,
@@ -0,0 +1,374 @@
+/*
+
+Tests of the parts of the contract that don't depend on contract state: the helpers that calculate prices,
+bids and index keys, and the serialization of the table rows.
+
+Rows from before a binary extension was added end before it, so it has no value when they are read. CDT writes
+an empty binary extension as its default value though, so every row that is written again stores all of them.
+
+*/
+
+
+#include <eosio/tester.hpp>
+
+#include <atomicmarket.cpp>
+
+#include <cstring>
+
+
+// The columns of a sale before the binary extensions were added
+struct legacy_sales_s {
+    uint64_t          sale_id;
+    name              seller;
+    vector <uint64_t> asset_ids;
+    int64_t           offer_id;
+    asset             listing_price;
+    symbol            settlement_symbol;
+    name              maker_marketplace;
+    name              collection_name;
+    double            collection_fee;
+};
+
+// The columns of an auction before the binary extensions were added
+struct legacy_auctions_s {
+    uint64_t          auction_id;
+    name              seller;
+    vector <uint64_t> asset_ids;
+    uint32_t          end_time;
+    bool              assets_transferred;
+    asset             current_bid;
+    name              current_bidder;
+    bool              claimed_by_seller;
+    bool              claimed_by_buyer;
+    name              maker_marketplace;
+    name              taker_marketplace;
+    name              collection_name;
+    double            collection_fee;
+};
+
+// The columns of a buyoffer before the binary extensions were added
+struct legacy_buyoffers_s {
+    uint64_t          buyoffer_id;
+    name              buyer;
+    name              recipient;
+    asset             price;
+    vector <uint64_t> asset_ids;
+    string            memo;
+    name              maker_marketplace;
+    name              collection_name;
+    double            collection_fee;
+};
+
+static const symbol WAX_SYMBOL = symbol("WAX", 8);
+static const symbol USD_SYMBOL = symbol("USD", 2);
+
+atomicmarket::sales_s create_sale(const std::optional <atomicmarket::DUTCH_PRICE> &dutch_price) {
+    atomicmarket::sales_s sale;
+    sale.sale_id = 1;
+    sale.seller = name("seller");
+    sale.asset_ids = {1099511627776};
+    sale.offer_id = 5;
+    sale.listing_price = asset(1000, WAX_SYMBOL);
+    sale.settlement_symbol = WAX_SYMBOL;
+    sale.maker_marketplace = name("market");
+    sale.collection_name = name("collection");
+    sale.collection_fee = 0.05;
+    sale.collection_fee_ppm = 50000;
+    sale.asset_ids_hash = get_stored_asset_ids_hash(sale.asset_ids);
+    sale.template_id = 7;
+    sale.dutch_price = dutch_price.value_or(atomicmarket::DUTCH_PRICE{});
+    return sale;
+}
+
+atomicmarket::auctions_s create_auction(asset current_bid, asset max_bid) {
+    atomicmarket::auctions_s auction;
+    auction.auction_id = 1;
+    auction.seller = name("seller");
+    auction.asset_ids = {1099511627776, 1099511627777};
+    auction.end_time = 1000;
+    auction.assets_transferred = true;
+    auction.current_bid = current_bid;
+    auction.current_bidder = name("bidder");
+    auction.claimed_by_seller = false;
+    auction.claimed_by_buyer = false;
+    auction.maker_marketplace = name("market");
+    auction.taker_marketplace = name("");
+    auction.collection_name = name("collection");
+    auction.collection_fee = 0.05;
+    auction.collection_fee_ppm = 50000;
+    auction.asset_ids_hash = get_stored_asset_ids_hash(auction.asset_ids);
+    auction.max_bid = max_bid;
+    return auction;
+}
+
+template <typename T>
+T repack(const T &row) {
+    return unpack <T>(pack(row));
+}
+
+
+EOSIO_TEST_BEGIN(decayed_amount)
+    // Before the start and after the end the amount stays the same
+    CHECK_EQUAL(get_decayed_amount(1000, 100, 100, 200, 0), 1000);
+    CHECK_EQUAL(get_decayed_amount(1000, 100, 100, 200, 100), 1000);
+    CHECK_EQUAL(get_decayed_amount(1000, 100, 100, 200, 200), 100);
+    CHECK_EQUAL(get_decayed_amount(1000, 100, 100, 200, UINT32_MAX), 100);
+
+    // In between, the amount decreases linearly
+    CHECK_EQUAL(get_decayed_amount(1000, 100, 100, 200, 150), 550);
+    CHECK_EQUAL(get_decayed_amount(1000, 100, 100, 200, 101), 991);
+    CHECK_EQUAL(get_decayed_amount(1000, 100, 100, 200, 199), 109);
+
+    // Rounding up, so that the price never drops below the schedule
+    CHECK_EQUAL(get_decayed_amount(10, 0, 0, 3, 1), 7);
+    CHECK_EQUAL(get_decayed_amount(10, 0, 0, 3, 2), 4);
+
+    // The largest amounts and durations don't overflow
+    CHECK_EQUAL(get_decayed_amount((uint64_t) asset::max_amount, 0, 0, UINT32_MAX, UINT32_MAX - 1),
+        (uint64_t) asset::max_amount / UINT32_MAX + 1);
+EOSIO_TEST_END
+
+
+EOSIO_TEST_BEGIN(sale_rows)
+    // A regular sale stores an empty dutch price, which must not make it a dutch sale
+    atomicmarket::sales_s regular_sale = repack(create_sale(std::nullopt));
+    CHECK_EQUAL(regular_sale.dutch_price.has_value(), true);
+    CHECK_EQUAL(regular_sale.is_dutch(), false);
+    CHECK_EQUAL(regular_sale.has_fixed_price(), true);
+    CHECK_EQUAL(regular_sale.get_price_at(1000).amount, 1000);
+    CHECK_EQUAL(regular_sale.get_price_amount(), 1000);
+    CHECK_EQUAL(regular_sale.collection_fee_ppm.value(), 50000);
+    CHECK_EQUAL(regular_sale.get_template_id(), 7);
+    CHECK_EQUAL(regular_sale.by_asset_id(), 1099511627776);
+    CHECK_EQUAL(is_unconverted_listing(regular_sale), false);
+
+    atomicmarket::sales_s dutch_sale = repack(create_sale(atomicmarket::DUTCH_PRICE{
+        .end_price = asset(100, WAX_SYMBOL),
+        .start_time = 100,
+        .end_time = 200
+    }));
+    CHECK_EQUAL(dutch_sale.is_dutch(), true);
+    CHECK_EQUAL(dutch_sale.has_fixed_price(), false);
+    CHECK_EQUAL(dutch_sale.get_price_at(150).amount, 550);
+    CHECK_EQUAL(dutch_sale.get_price_at(300).amount, 100);
+    CHECK_EQUAL(dutch_sale.get_price_amount(), UINT64_MAX);
+
+    // A sale that is not active yet is ordered after the active ones
+    atomicmarket::sales_s inactive_sale = create_sale(std::nullopt);
+    inactive_sale.offer_id = -1;
+    CHECK_EQUAL(repack(inactive_sale).get_price_amount(), UINT64_MAX);
+EOSIO_TEST_END
+
+
+EOSIO_TEST_BEGIN(legacy_sale_rows)
+    atomicmarket::sales_s legacy_sale = unpack <atomicmarket::sales_s>(pack(legacy_sales_s{
+        .sale_id = 1,
+        .seller = name("seller"),
+        .asset_ids = {1099511627776},
+        .offer_id = 5,
+        .listing_price = asset(1000, WAX_SYMBOL),
+        .settlement_symbol = WAX_SYMBOL,
+        .maker_marketplace = name("market"),
+        .collection_name = name("collection"),
+        .collection_fee = 0.05
+    }));
+
+    CHECK_EQUAL(legacy_sale.collection_fee_ppm.has_value(), false);
+    CHECK_EQUAL(legacy_sale.asset_ids_hash.has_value(), false);
+    CHECK_EQUAL(legacy_sale.template_id.has_value(), false);
+    CHECK_EQUAL(legacy_sale.dutch_price.has_value(), false);
+
+    CHECK_EQUAL(legacy_sale.is_dutch(), false);
+    CHECK_EQUAL(legacy_sale.get_price_at(1000).amount, 1000);
+    CHECK_EQUAL(legacy_sale.get_template_id(), -1);
+    CHECK_EQUAL(legacy_sale.by_asset_id(), 0);
+    CHECK_EQUAL(get_collection_fee_ppm(legacy_sale), 50000);
+    CHECK_EQUAL(is_unconverted_listing(legacy_sale), true);
+
+    // Writing the row without filling the extensions stores their default values
+    atomicmarket::sales_s rewritten_sale = repack(legacy_sale);
+    CHECK_EQUAL(rewritten_sale.collection_fee_ppm.has_value(), true);
+    CHECK_EQUAL(get_collection_fee_ppm(rewritten_sale), 0);
+    CHECK_EQUAL(rewritten_sale.is_dutch(), false);
+EOSIO_TEST_END
+
+
+EOSIO_TEST_BEGIN(next_bid_amount)
+    CHECK_EQUAL(get_next_bid_amount(100, 100000), 110);
+    CHECK_EQUAL(get_next_bid_amount(1000, 0), 1000);
+
+    // Rounding up, so that a bid always increases by at least 1 if there is a minimum bid increase
+    CHECK_EQUAL(get_next_bid_amount(1, 100000), 2);
+    CHECK_EQUAL(get_next_bid_amount(101, 100000), 112);
+
+    // Capped at the maximum asset amount
+    CHECK_EQUAL(get_next_bid_amount((uint64_t) asset::max_amount, 100000), (uint64_t) asset::max_amount);
+    CHECK_EQUAL(get_next_bid_amount((uint64_t) asset::max_amount - 1, 1), (uint64_t) asset::max_amount);
+EOSIO_TEST_END
+
+
+EOSIO_TEST_BEGIN(auction_rows)
+    // The maximum bid of a proxy bid survives writing the row
+    atomicmarket::auctions_s proxy_auction = repack(create_auction(asset(100, WAX_SYMBOL), asset(500, WAX_SYMBOL)));
+    CHECK_EQUAL(proxy_auction.max_bid.value().amount, 500);
+    CHECK_EQUAL(get_escrowed_bid(proxy_auction).amount, 500);
+    CHECK_EQUAL(proxy_auction.by_end_time(), 1000);
+
+    atomicmarket::auctions_s regular_auction = repack(create_auction(asset(100, WAX_SYMBOL), asset(100, WAX_SYMBOL)));
+    CHECK_EQUAL(get_escrowed_bid(regular_auction).amount, 100);
+
+    // A row that was written with an empty maximum bid has only escrowed the current bid
+    atomicmarket::auctions_s empty_max_bid_auction = repack(create_auction(asset(100, WAX_SYMBOL), asset()));
+    CHECK_EQUAL(empty_max_bid_auction.max_bid.has_value(), true);
+    CHECK_EQUAL(get_escrowed_bid(empty_max_bid_auction) == asset(100, WAX_SYMBOL), true);
+EOSIO_TEST_END
+
+
+EOSIO_TEST_BEGIN(legacy_auction_rows)
+    atomicmarket::auctions_s legacy_auction = unpack <atomicmarket::auctions_s>(pack(legacy_auctions_s{
+        .auction_id = 1,
+        .seller = name("seller"),
+        .asset_ids = {1099511627776},
+        .end_time = 1000,
+        .assets_transferred = true,
+        .current_bid = asset(100, WAX_SYMBOL),
+        .current_bidder = name("bidder"),
+        .claimed_by_seller = false,
+        .claimed_by_buyer = false,
+        .maker_marketplace = name("market"),
+        .taker_marketplace = name(""),
+        .collection_name = name("collection"),
+        .collection_fee = 0.05
+    }));
+
+    CHECK_EQUAL(legacy_auction.collection_fee_ppm.has_value(), false);
+    CHECK_EQUAL(legacy_auction.asset_ids_hash.has_value(), false);
+    CHECK_EQUAL(legacy_auction.max_bid.has_value(), false);
+
+    CHECK_EQUAL(get_escrowed_bid(legacy_auction) == asset(100, WAX_SYMBOL), true);
+    CHECK_EQUAL(get_collection_fee_ppm(legacy_auction), 50000);
+    CHECK_EQUAL(legacy_auction.by_asset_id(), 0);
+    CHECK_EQUAL(is_unconverted_listing(legacy_auction), true);
+
+    // Writing the row without filling the extensions stores an empty maximum bid, which still refunds
+    // the current bid
+    atomicmarket::auctions_s rewritten_auction = repack(legacy_auction);
+    CHECK_EQUAL(rewritten_auction.max_bid.has_value(), true);
+    CHECK_EQUAL(get_escrowed_bid(rewritten_auction) == asset(100, WAX_SYMBOL), true);
+EOSIO_TEST_END
+
+
+EOSIO_TEST_BEGIN(sale_price_keys)
+    // Sales are ordered by their settlement symbol and then by price
+    CHECK_EQUAL(sale_price_key(WAX_SYMBOL, 100) < sale_price_key(WAX_SYMBOL, 200), true);
+    CHECK_EQUAL(sale_price_key(WAX_SYMBOL, 200) < sale_price_key(WAX_SYMBOL, UINT64_MAX), true);
+    CHECK_EQUAL(sale_price_key(USD_SYMBOL, UINT64_MAX) < sale_price_key(WAX_SYMBOL, 0), true);
+    CHECK_EQUAL(sale_price_key(WAX_SYMBOL, 100) == sale_price_key(symbol("WAX", 4), 100), false);
+
+    // With a template, sales are ordered by template first. Sales without a template (-1) come last
+    CHECK_EQUAL(sale_template_price_key(1, WAX_SYMBOL, 100) < sale_template_price_key(1, WAX_SYMBOL, 200), true);
+    CHECK_EQUAL(sale_template_price_key(1, WAX_SYMBOL, UINT64_MAX) < sale_template_price_key(2, USD_SYMBOL, 0), true);
+    CHECK_EQUAL(sale_template_price_key(1, USD_SYMBOL, UINT64_MAX) < sale_template_price_key(1, WAX_SYMBOL, 0), true);
+    CHECK_EQUAL(sale_template_price_key(INT32_MAX, WAX_SYMBOL, 0) < sale_template_price_key(-1, WAX_SYMBOL, 0), true);
+
+    // The keys of a sale row use its price, or the end of the order if the price is not fixed
+    atomicmarket::sales_s sale = create_sale(std::nullopt);
+    CHECK_EQUAL(sale.by_price() == sale_price_key(WAX_SYMBOL, 1000), true);
+    CHECK_EQUAL(sale.by_template_price() == sale_template_price_key(7, WAX_SYMBOL, 1000), true);
+
+    sale.listing_price = asset(1000, USD_SYMBOL);
+    CHECK_EQUAL(sale.by_price() == sale_price_key(WAX_SYMBOL, UINT64_MAX), true);
+EOSIO_TEST_END
+
+
+EOSIO_TEST_BEGIN(template_buyoffer_price_keys)
+    // Template buyoffers are ordered by template, then by symbol, and then by price, starting with the highest
+    CHECK_EQUAL(template_buyoffer_price_key(1, WAX_SYMBOL, 200) < template_buyoffer_price_key(1, WAX_SYMBOL, 100), true);
+    CHECK_EQUAL(template_buyoffer_price_key(1, WAX_SYMBOL, UINT64_MAX) < template_buyoffer_price_key(1, WAX_SYMBOL, 0),
+        true);
+    CHECK_EQUAL(template_buyoffer_price_key(1, USD_SYMBOL, 0) < template_buyoffer_price_key(1, WAX_SYMBOL, 1000), true);
+    CHECK_EQUAL(template_buyoffer_price_key(1, WAX_SYMBOL, 0) < template_buyoffer_price_key(2, WAX_SYMBOL, 1000), true);
+
+    atomicmarket::template_buyoffer_s buyoffer = {
+        .buyoffer_id = 1,
+        .buyer = name("buyer"),
+        .price = asset(500, WAX_SYMBOL),
+        .template_id = 7,
+        .maker_marketplace = name("market"),
+        .collection_name = name("collection"),
+        .collection_fee = 0.05,
+        .collection_fee_ppm = 50000
+    };
+    CHECK_EQUAL(repack(buyoffer).by_template_price() == template_buyoffer_price_key(7, WAX_SYMBOL, 500), true);
+EOSIO_TEST_END
+
+
+EOSIO_TEST_BEGIN(fee_shares)
+    CHECK_EQUAL(apply_fee_ppm(1000, 50000), 50);
+    CHECK_EQUAL(apply_fee_ppm(1000, 0), 0);
+
+    // Rounding down
+    CHECK_EQUAL(apply_fee_ppm(999, 50000), 49);
+    CHECK_EQUAL(apply_fee_ppm(19, 50000), 0);
+
+    // The largest amounts don't overflow
+    CHECK_EQUAL(apply_fee_ppm((uint64_t) asset::max_amount, FEE_PPM_SCALE), (uint64_t) asset::max_amount);
+    CHECK_EQUAL(apply_fee_ppm((uint64_t) asset::max_amount, 10000), (uint64_t) asset::max_amount / 100);
+
+    // The fee shares of a sale never add up to more than its price, so the seller's cut that purchasecart
+    // adds up for each seller can't become negative
+    bool fees_within_price = true;
+    for (uint64_t amount = 1; amount <= 1000; amount++) {
+        uint64_t fees = apply_fee_ppm(amount, 20000) + apply_fee_ppm(amount, 20000)
+            + apply_fee_ppm(amount, fee_to_ppm(atomicassets::MAX_MARKET_FEE));
+        fees_within_price = fees_within_price && fees <= amount;
+    }
+    CHECK_EQUAL(fees_within_price, true);
+EOSIO_TEST_END
+
+
+EOSIO_TEST_BEGIN(buyoffer_rows)
+    // acceptbuyos pays out each buyoffer with its collection fee, which older rows only store as a double
+    legacy_buyoffers_s legacy_row = {
+        .buyoffer_id = 1,
+        .buyer = name("buyer"),
+        .recipient = name("recipient"),
+        .price = asset(1000, WAX_SYMBOL),
+        .asset_ids = {1099511627776},
+        .memo = "offer",
+        .maker_marketplace = name("market"),
+        .collection_name = name("collection"),
+        .collection_fee = 0.075
+    };
+    atomicmarket::buyoffers_s legacy_buyoffer = unpack <atomicmarket::buyoffers_s>(pack(legacy_row));
+    CHECK_EQUAL(legacy_buyoffer.collection_fee_ppm.has_value(), false);
+    CHECK_EQUAL(get_collection_fee_ppm(legacy_buyoffer), 75000);
+    CHECK_EQUAL(legacy_buyoffer.memo == "offer", true);
+
+    atomicmarket::buyoffers_s buyoffer = legacy_buyoffer;
+    buyoffer.collection_fee_ppm = 60000;
+    buyoffer = repack(buyoffer);
+    CHECK_EQUAL(get_collection_fee_ppm(buyoffer), 60000);
+    CHECK_EQUAL(buyoffer.price == asset(1000, WAX_SYMBOL), true);
+EOSIO_TEST_END
+
+
+int main(int argc, char *argv[]) {
+    bool verbose = false;
+    if (argc >= 2 && std::strcmp(argv[1], "-v") == 0) {
+        verbose = true;
+    }
+    silence_output(!verbose);
+
+    EOSIO_TEST(decayed_amount);
+    EOSIO_TEST(sale_rows);
+    EOSIO_TEST(legacy_sale_rows);
+    EOSIO_TEST(next_bid_amount);
+    EOSIO_TEST(auction_rows);
+    EOSIO_TEST(legacy_auction_rows);
+    EOSIO_TEST(sale_price_keys);
+    EOSIO_TEST(template_buyoffer_price_keys);
+    EOSIO_TEST(fee_shares);
+    EOSIO_TEST(buyoffer_rows);
+    return has_failed();
+}
@@ -0,0 +1,157 @@
+/*
+
+Compares the integer delphi conversion kernel with the floating point formula that purchasesale used before.
+
+The old formula is evaluated with a signed exponent. The contract used to compute the exponent with unsigned
+integers, which wrapped around for inverted pairs with a negative exponent.
+
+*/
+
+
+#include <eosio/tester.hpp>
+#include <eosio/asset.hpp>
+
+#include <delphi-conversion.hpp>
+
+#include <cmath>
+#include <cstring>
+
+using namespace delphiconversion;
+
+
+// The floating point formula of purchasesale before the integer conversion
+uint64_t convert_price_double(
+    uint64_t listing_amount,
+    uint64_t median,
+    bool invert_delphi_pair,
+    uint64_t quoted_precision,
+    uint8_t listing_precision,
+    uint8_t settlement_precision
+) {
+    int32_t exponent = (int32_t) settlement_precision - (int32_t) listing_precision;
+    if (!invert_delphi_pair) {
+        return (double) listing_amount / (double) median * pow(10, exponent + (int32_t) quoted_precision);
+    } else {
+        return (double) listing_amount * (double) median * pow(10, exponent - (int32_t) quoted_precision);
+    }
+}
+
+// Both results may only differ by the error of the double formula: a few units in the last place of the
+// double result, plus one for truncating it
+bool is_close_to_double(uint64_t exact, uint64_t approximate) {
+    uint64_t difference = exact > approximate ? exact - approximate : approximate - exact;
+    return difference <= (uint64_t) ((double) exact * 1e-15) + 1;
+}
+
+
+EOSIO_TEST_BEGIN(matches_double_formula_for_exact_values)
+    // WAX (8) listed in USD (2), delphi pair waxpusd with a quoted precision of 4
+    CHECK_EQUAL(convert_price(100, 5000, false, 4, 2, 8, ROUND_DOWN),
+        convert_price_double(100, 5000, false, 4, 2, 8));
+    CHECK_EQUAL(convert_price(100, 5000, false, 4, 2, 8, ROUND_DOWN), 200000000);
+
+    // Inverted pair, listing in WAX (8) and settling in USD (2)
+    CHECK_EQUAL(convert_price(200000000, 5000, true, 4, 8, 2, ROUND_DOWN),
+        convert_price_double(200000000, 5000, true, 4, 8, 2));
+    CHECK_EQUAL(convert_price(200000000, 5000, true, 4, 8, 2, ROUND_DOWN), 100);
+
+    // Same precisions on both sides
+    CHECK_EQUAL(convert_price(12345, 1, false, 0, 4, 4, ROUND_DOWN),
+        convert_price_double(12345, 1, false, 0, 4, 4));
+    CHECK_EQUAL(convert_price(12345, 1, true, 0, 4, 4, ROUND_DOWN),
+        convert_price_double(12345, 1, true, 0, 4, 4));
+
+    // Sweep over amounts, medians and precisions. The double formula can be one unit too low when the
+    // exact result is an integer that the double division only approximates
+    for (uint64_t listing_amount : {1ULL, 7ULL, 100ULL, 99999ULL, 123456789ULL}) {
+        for (uint64_t median : {1ULL, 2ULL, 3ULL, 4ULL, 5ULL, 8ULL, 10ULL, 16ULL, 25ULL, 10000ULL}) {
+            for (uint8_t settlement_precision = 0; settlement_precision <= 8; settlement_precision++) {
+                CHECK_EQUAL(is_close_to_double(
+                    convert_price(listing_amount, median, false, 4, 2, settlement_precision, ROUND_DOWN),
+                    convert_price_double(listing_amount, median, false, 4, 2, settlement_precision)
+                ), true);
+            }
+        }
+    }
+EOSIO_TEST_END
+
+
+EOSIO_TEST_BEGIN(rounding_edge_cases)
+    // 1 / 3 is not exact: rounding down truncates like the double formula, rounding up adds one
+    CHECK_EQUAL(convert_price(1, 3, false, 0, 0, 0, ROUND_DOWN), convert_price_double(1, 3, false, 0, 0, 0));
+    CHECK_EQUAL(convert_price(1, 3, false, 0, 0, 0, ROUND_DOWN), 0);
+    CHECK_EQUAL(convert_price(1, 3, false, 0, 0, 0, ROUND_UP), 1);
+    CHECK_EQUAL(convert_price(10, 3, false, 0, 0, 0, ROUND_DOWN), 3);
+    CHECK_EQUAL(convert_price(10, 3, false, 0, 0, 0, ROUND_UP), 4);
+
+    // Exact divisions are never rounded up
+    CHECK_EQUAL(convert_price(9, 3, false, 0, 0, 0, ROUND_UP), 3);
+    CHECK_EQUAL(convert_price(100, 5000, false, 4, 2, 8, ROUND_UP), 200000000);
+
+    // A negative exponent divides, so the precision that is dropped is rounded explicitly
+    CHECK_EQUAL(convert_price(123456789, 1, true, 0, 8, 2, ROUND_DOWN), 123);
+    CHECK_EQUAL(convert_price(123456789, 1, true, 0, 8, 2, ROUND_UP), 124);
+    CHECK_EQUAL(convert_price(123000000, 1, true, 0, 8, 2, ROUND_UP), 123);
+
+    // 123456789 / 25 * 10^2 is exactly 493827156, which the double formula truncates to 493827155
+    CHECK_EQUAL(convert_price_double(123456789, 25, false, 4, 2, 0), 493827155);
+    CHECK_EQUAL(convert_price(123456789, 25, false, 4, 2, 0, ROUND_DOWN), 493827156);
+    CHECK_EQUAL(convert_price(123456789, 25, false, 4, 2, 0, ROUND_UP), 493827156);
+EOSIO_TEST_END
+
+
+EOSIO_TEST_BEGIN(large_medians_and_precisions)
+    // Above 2^53 the double formula is no longer exact, but it stays within its own rounding error
+    uint64_t large_amount = (1ULL << 60) + 12345;
+    uint64_t exact = convert_price(large_amount, 3, false, 0, 0, 0, ROUND_DOWN);
+    CHECK_EQUAL(exact, large_amount / 3);
+    CHECK_EQUAL(is_close_to_double(exact, convert_price_double(large_amount, 3, false, 0, 0, 0)), true);
+
+    // Large medians only make the normal conversion smaller
+    uint64_t large_median = UINT64_MAX - 1;
+    CHECK_EQUAL(convert_price(1000000000, large_median, false, 8, 8, 8, ROUND_DOWN), 0);
+    CHECK_EQUAL(convert_price(1000000000, large_median, false, 8, 8, 8, ROUND_UP), 1);
+    uint64_t large_median_exact = convert_price((uint64_t) asset::max_amount, large_median, false, 18, 0, 0, ROUND_DOWN);
+    CHECK_EQUAL(is_close_to_double(
+        large_median_exact,
+        convert_price_double((uint64_t) asset::max_amount, large_median, false, 18, 0, 0)
+    ), true);
+
+    // Inverted conversions with a large median need the 128 bit intermediate
+    uint64_t inverted_exact = convert_price(1ULL << 40, 1ULL << 40, true, 20, 0, 0, ROUND_DOWN);
+    CHECK_EQUAL(is_close_to_double(inverted_exact, convert_price_double(1ULL << 40, 1ULL << 40, true, 20, 0, 0)), true);
+
+    // The full range of exponents up to 10^38
+    CHECK_EQUAL(convert_price(1, 1000000000000000000ULL, false, 18, 0, 18, ROUND_DOWN), 1000000000000000000ULL);
+    CHECK_EQUAL(convert_price(1, 10, false, 18, 0, 0, ROUND_DOWN), 100000000000000000ULL);
+    CHECK_EQUAL(convert_price(1, 10, false, 18, 0, 0, ROUND_DOWN), convert_price_double(1, 10, false, 18, 0, 0));
+    CHECK_EQUAL(convert_price(4611686018427387903ULL, 1, true, 38, 0, 0, ROUND_DOWN), 0);
+    CHECK_EQUAL(convert_price(4611686018427387903ULL, 1, true, 38, 0, 0, ROUND_UP), 1);
+
+    CHECK_ASSERT("The converted price is too large", ([]() {
+        convert_price((uint64_t) asset::max_amount, 1, false, 18, 0, 0, ROUND_DOWN);
+    }));
+    CHECK_ASSERT("The precisions of the delphi pair can not be converted", ([]() {
+        convert_price(1, 1, false, 38, 0, 18, ROUND_DOWN);
+    }));
+    CHECK_ASSERT("The quoted precision of the delphi pair is too large", ([]() {
+        convert_price(1, 1, false, 39, 0, 0, ROUND_DOWN);
+    }));
+    CHECK_ASSERT("The delphi median must be greater than zero", ([]() {
+        convert_price(1, 0, false, 4, 2, 8, ROUND_DOWN);
+    }));
+EOSIO_TEST_END
+
+
+int main(int argc, char *argv[]) {
+    bool verbose = false;
+    if (argc >= 2 && std::strcmp(argv[1], "-v") == 0) {
+        verbose = true;
+    }
+    silence_output(!verbose);
+
+    EOSIO_TEST(matches_double_formula_for_exact_values);
+    EOSIO_TEST(rounding_edge_cases);
+    EOSIO_TEST(large_medians_and_precisions);
+    return has_failed();
+}